@@ -30,11 +30,40 @@
 #include <boost/filesystem/operations.hpp> // absolute()
 #include <boost/filesystem.hpp>
 
-#include <cstdlib> // getenv(), system()
+#include <sys/stat.h> // lstat()
+#include <sys/file.h> // flock()
+#include <sched.h> // sched_getaffinity()
+#include <fcntl.h> // open(), posix_fadvise()
+#include <unistd.h> // read(), close(), copy_file_range()
+#include <sys/ioctl.h> // ioctl()
+#include <sys/sendfile.h> // sendfile()
+#include <linux/fs.h> // FICLONE
+#include <sys/mman.h> // mmap()
+#include <sys/syscall.h> // syscall()
+#ifdef HAS_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include <cstdlib> // getenv(), setenv(), system(), atexit()
+#include <cstring> // memmove()
+#include <cmath> // sqrt(), ceil()
+#include <cerrno>
+#include <ctime> // time(), clock_gettime()
 
 #include <stdexcept>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <iomanip> // setw()
+#include <algorithm> // sort()
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception> // exception_ptr
 #include <cassert>
 
 
@@ -76,6 +105,393 @@
 
 //####################################################################
 
+// Call profiling, enabled by the SCRACC_PROFILE environment variable:
+//
+//     SCRACC_PROFILE=table         summary table on stderr at exit
+//     SCRACC_PROFILE=json          one JSON object on stderr at exit
+//     SCRACC_PROFILE=json:<file>   ... appended to <file> instead
+//
+// Every thread counts into its own block of counters, so recording takes
+// no lock and no atomic read-modify-write. The blocks are summed at exit.
+// When profiling is off, an entry point only pays for testing sProfile.
+
+#define SPP_PROFILED_APIS(X) \
+    X(SetThrowExceptions, "SetThrowExceptions") \
+    X(SetEnv, "SetEnv") \
+    X(GetEnv, "GetEnv") \
+    X(Md5Sum, "Md5Sum") \
+    X(ReadFile, "ReadFile") \
+    X(WriteFile, "WriteFile") \
+    X(Execute, "Execute") \
+    X(GetCwd, "GetCwd") \
+    X(ChDir, "ChDir") \
+    X(MkDir, "MkDir") \
+    X(MkDirPath, "MkDirPath") \
+    X(Remove, "Remove") \
+    X(RemoveAll, "RemoveAll") \
+    X(BaseName, "BaseName") \
+    X(DirName, "DirName") \
+    X(NormalizePath, "NormalizePath") \
+    X(AbsolutePath, "AbsolutePath") \
+    X(BuildPath, "BuildPath") \
+    X(Exists, "Exists") \
+    X(IsDir, "IsDir") \
+    X(IsRegularFile, "IsRegularFile") \
+    X(IsFile, "IsFile") \
+    X(IsSymlink, "IsSymlink") \
+    X(Symlink, "Symlink") \
+    X(ReadLink, "ReadLink") \
+    X(FileSize, "FileSize") \
+    X(Owner, "Owner") \
+    X(Group, "Group") \
+    X(Permission, "Permission") \
+    X(ChMod, "ChMod") \
+    X(ChOwn, "ChOwn") \
+    X(ChGrp, "ChGrp") \
+    X(Find, "Find") \
+    X(FindAndDo, "FindAndDo") \
+    X(ThreadPoolRun, "ThreadPool::Run") \
+    X(HashTree, "HashTree") \
+    X(CopyFile, "CopyFile") \
+    X(CopyTree, "CopyTree") \
+    X(MoveTree, "MoveTree") \
+    X(ReadFiles, "ReadFiles") \
+    X(WriteFiles, "WriteFiles") \
+    X(ReadFilesAsync, "ReadFilesAsync") \
+    X(WriteFilesAsync, "WriteFilesAsync") \
+    X(StoreOpen, "Store::Store") \
+    X(StoreGet, "Store::Get") \
+    X(StoreHas, "Store::Has") \
+    X(StorePut, "Store::Put") \
+    X(StoreErase, "Store::Erase") \
+    X(StoreKeys, "Store::Keys") \
+    X(StoreCompact, "Store::Compact") \
+    X(StoreMemoize, "Store::Memoize") \
+    X(Bench, "Bench") \
+    X(BenchGroup, "BenchGroup") \
+    X(ForEachRecord, "ForEachRecord")
+
+#define SPP_PROFILE(api) \
+    ProfileScope sppProfile(kApi##api)
+
+namespace
+{
+
+using namespace std;
+
+enum ProfiledApi
+{
+#define SPP_API_ID(id, name) kApi##id,
+    SPP_PROFILED_APIS(SPP_API_ID)
+#undef SPP_API_ID
+    kApiCount
+};
+
+const char * const kApiNames[] =
+{
+#define SPP_API_NAME(id, name) name,
+    SPP_PROFILED_APIS(SPP_API_NAME)
+#undef SPP_API_NAME
+};
+
+struct ApiCounters
+{
+    atomic<uint64_t> calls;
+    atomic<uint64_t> totalNs;
+    atomic<uint64_t> maxNs;
+    atomic<uint64_t> bytesRead;
+    atomic<uint64_t> bytesWritten;
+};
+
+struct ThreadCounters
+{
+    ApiCounters api[kApiCount];
+    atomic<uint64_t> outerNs;   // time in outermost libscracc calls
+    int depth;                  // only touched by the owning thread
+    uint64_t userNs;            // time in user callbacks, same
+};
+
+bool sProfile = false;
+string sProfileSpec;
+uint64_t sProfileStartNs = 0;
+mutex sProfileMutex;
+ThreadCounters sRetiredProfile;     // sum of the threads that have finished
+vector<ThreadCounters *> sProfileThreads(1, &sRetiredProfile);
+thread_local ThreadCounters * tProfile = nullptr;
+
+/// Folds the counters of a finishing thread into sRetiredProfile, so
+/// programs that start threads per call (std::async, HashTree with its
+/// own threads) do not keep a block per thread.
+struct ProfileRetirer
+{
+    ~ProfileRetirer();
+};
+
+thread_local ProfileRetirer tProfileRetirer;
+
+uint64_t MonotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/// Only the owning thread writes a counter, so a plain load + store is enough.
+void Bump(atomic<uint64_t> & counter, uint64_t value)
+{
+    counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+class ProfileScope
+{
+public:
+    explicit ProfileScope(ProfiledApi api)
+        : mCounters (nullptr)
+    {
+        if (__builtin_expect(sProfile, false)) {
+            Begin(api);
+        }
+    }
+    ~ProfileScope()
+    {
+        if (__builtin_expect(mCounters != nullptr, false)) {
+            End();
+        }
+    }
+    void AddRead(uint64_t bytes)
+    {
+        if (mCounters) {
+            Bump(mCounters->bytesRead, bytes);
+        }
+    }
+    void AddWritten(uint64_t bytes)
+    {
+        if (mCounters) {
+            Bump(mCounters->bytesWritten, bytes);
+        }
+    }
+    /// True if this call was made by user code and is being recorded.
+    bool IsRecording() const
+    {
+        return mCounters != nullptr;
+    }
+private:
+    ApiCounters * mCounters;
+    uint64_t mStartNs;
+    uint64_t mUserNs;
+
+    void Begin(ProfiledApi api) __attribute__((noinline));
+    void End() __attribute__((noinline));
+};
+
+/// Wraps a call from libscracc back into user code (predicates, record
+/// callbacks, pool tasks...). libscracc calls made from there count as
+/// the user's own, and their time is not charged to the enclosing call.
+class UserCodeScope
+{
+public:
+    UserCodeScope()
+        : mActive (false)
+    {
+        if (__builtin_expect(sProfile && tProfile && tProfile->depth > 0, false)) {
+            Enter();
+        }
+    }
+    ~UserCodeScope()
+    {
+        if (__builtin_expect(mActive, false)) {
+            Leave();
+        }
+    }
+private:
+    bool mActive;
+    int mDepth;
+    uint64_t mUserNs;
+    uint64_t mStartNs;
+
+    void Enter() __attribute__((noinline));
+    void Leave() __attribute__((noinline));
+};
+
+template <typename F, typename... Args>
+auto CallUserCode(F && f, Args &&... args) -> decltype(f(std::forward<Args>(args)...))
+{
+    UserCodeScope user;
+    return f(std::forward<Args>(args)...);
+}
+
+void ProfileScope::Begin(ProfiledApi api)
+{
+    if (!tProfile) {
+        // Taking the address constructs the retirer, so it runs at thread exit.
+        (void)&tProfileRetirer;
+        tProfile = new ThreadCounters();
+        lock_guard<mutex> lock(sProfileMutex);
+        sProfileThreads.push_back(tProfile);
+    }
+    if (tProfile->depth > 0) {
+        // Called by another libscracc function, not by the user:
+        // the outer call already accounts for it.
+        return;
+    }
+    ++tProfile->depth;
+    mCounters = &tProfile->api[api];
+    mUserNs = tProfile->userNs;
+    mStartNs = MonotonicNs();
+}
+
+void ProfileScope::End()
+{
+    const uint64_t ns = MonotonicNs() - mStartNs - (tProfile->userNs - mUserNs);
+    Bump(mCounters->calls, 1);
+    Bump(mCounters->totalNs, ns);
+    if (ns > mCounters->maxNs.load(memory_order_relaxed)) {
+        mCounters->maxNs.store(ns, memory_order_relaxed);
+    }
+    --tProfile->depth;
+    Bump(tProfile->outerNs, ns);
+}
+
+ProfileRetirer::~ProfileRetirer()
+{
+    if (!tProfile) {
+        return;
+    }
+    lock_guard<mutex> lock(sProfileMutex);
+    for (int a = 0; a < kApiCount; ++a) {
+        const ApiCounters & c = tProfile->api[a];
+        ApiCounters & r = sRetiredProfile.api[a];
+        // The mutex serializes the writers of the retired counters.
+        Bump(r.calls, c.calls);
+        Bump(r.totalNs, c.totalNs);
+        Bump(r.bytesRead, c.bytesRead);
+        Bump(r.bytesWritten, c.bytesWritten);
+        if (c.maxNs > r.maxNs) {
+            r.maxNs.store(c.maxNs, memory_order_relaxed);
+        }
+    }
+    Bump(sRetiredProfile.outerNs, tProfile->outerNs);
+    sProfileThreads.erase(find(sProfileThreads.begin(), sProfileThreads.end(), tProfile));
+    delete tProfile;
+    tProfile = nullptr;
+}
+
+void UserCodeScope::Enter()
+{
+    mActive = true;
+    mDepth = tProfile->depth;
+    mUserNs = tProfile->userNs;
+    tProfile->depth = 0;
+    mStartNs = MonotonicNs();
+}
+
+void UserCodeScope::Leave()
+{
+    // Overwrite what nested calls added: all of this is user time for the
+    // enclosing call, and it must be subtracted only once.
+    tProfile->userNs = mUserNs + (MonotonicNs() - mStartNs);
+    tProfile->depth = mDepth;
+}
+
+void DumpProfile()
+{
+    struct Totals
+    {
+        const char * name;
+        uint64_t calls, totalNs, maxNs, bytesRead, bytesWritten;
+    };
+    vector<Totals> totals;
+    uint64_t outerNs = 0;
+    {
+        lock_guard<mutex> lock(sProfileMutex);
+        for (int a = 0; a < kApiCount; ++a) {
+            Totals t = { kApiNames[a], 0, 0, 0, 0, 0 };
+            for (const ThreadCounters * tc : sProfileThreads) {
+                const ApiCounters & c = tc->api[a];
+                t.calls += c.calls;
+                t.totalNs += c.totalNs;
+                t.maxNs = max<uint64_t>(t.maxNs, c.maxNs);
+                t.bytesRead += c.bytesRead;
+                t.bytesWritten += c.bytesWritten;
+            }
+            if (t.calls > 0) {
+                totals.push_back(t);
+            }
+        }
+        for (const ThreadCounters * tc : sProfileThreads) {
+            outerNs += tc->outerNs;
+        }
+    }
+    sort(begin(totals), end(totals),
+         [](const Totals & a, const Totals & b) { return a.totalNs > b.totalNs; });
+    const uint64_t wallNs = MonotonicNs() - sProfileStartNs;
+
+    ostringstream out;
+    const string format = sProfileSpec.substr(0, sProfileSpec.find(':'));
+    if (format == "json") {
+        out << "{\"program\":\"" << program_invocation_short_name << "\""
+            << ",\"pid\":" << getpid()
+            << ",\"wall_ns\":" << wallNs
+            << ",\"libscracc_ns\":" << outerNs
+            << ",\"apis\":[";
+        for (size_t i = 0; i < totals.size(); ++i) {
+            const Totals & t = totals[i];
+            out << (i ? "," : "")
+                << "{\"name\":\"" << t.name << "\""
+                << ",\"calls\":" << t.calls
+                << ",\"total_ns\":" << t.totalNs
+                << ",\"max_ns\":" << t.maxNs
+                << ",\"bytes_read\":" << t.bytesRead
+                << ",\"bytes_written\":" << t.bytesWritten << "}";
+        }
+        out << "]}\n";
+    }
+    else {
+        out << "SCRACC_PROFILE " << program_invocation_short_name << " (pid " << getpid() << "): "
+            << "wall " << wallNs / 1e6 << " ms, in libscracc " << outerNs / 1e6
+            << " ms (outermost calls, all threads)\n";
+        out << left << setw(20) << "api" << right
+            << setw(10) << "calls" << setw(14) << "total ms" << setw(12) << "avg us"
+            << setw(12) << "max us" << setw(14) << "read B" << setw(14) << "written B" << "\n";
+        for (const Totals & t : totals) {
+            out << left << setw(20) << t.name << right << fixed << setprecision(3)
+                << setw(10) << t.calls
+                << setw(14) << t.totalNs / 1e6
+                << setw(12) << t.totalNs / 1e3 / t.calls
+                << setw(12) << t.maxNs / 1e3
+                << setw(14) << t.bytesRead
+                << setw(14) << t.bytesWritten << "\n";
+        }
+    }
+
+    const auto colon = sProfileSpec.find(':');
+    if (colon != string::npos) {
+        ofstream ofs(sProfileSpec.substr(colon + 1), ofstream::out | ofstream::app);
+        ofs << out.str();
+    }
+    else {
+        cerr << out.str();
+    }
+}
+
+struct ProfileInit
+{
+    ProfileInit()
+    {
+        const char * spec = getenv("SCRACC_PROFILE");
+        if (spec && *spec) {
+            sProfileSpec = spec;
+            sProfileStartNs = MonotonicNs();
+            sProfile = true;
+            atexit(DumpProfile);
+        }
+    }
+} sProfileInit;
+
+} // namespace anonymous
+
+//####################################################################
+
 namespace
 {
 
@@ -95,11 +511,8 @@ using namespace std;
 /// @return The stripped path.
 string StripExtraSlashes(string path)
 {
-   size_t pos;
-   while ( (pos = path.find("//")) != string::npos )
-   {
-      path = path.replace(pos, 2, "/");
-   }
+   path.resize(Scracc::NormalizePath(path.data(), path.size(), &path[0],
+                                     Scracc::NormalizeSlashes));
    return path;
 }
 
@@ -114,22 +527,27 @@ using namespace std;
 using namespace boost::filesystem;
 
 bool sThrowExceptions = true;
-boost::system::error_code sErrorCode;
+// Per thread: the functions are also called from Parallel*() bodies.
+thread_local boost::system::error_code sErrorCode;
 
 //####################################################################
 
 void SetThrowExceptions(bool throwExceptions)
 {
+    SPP_PROFILE(SetThrowExceptions);
     sThrowExceptions = throwExceptions;
 }
 
 void SetEnv(const string & name, const string & value, bool * ok)
 {
-    assert(false);
+    SPP_PROFILE(SetEnv);
+    bool success = (setenv(name.c_str(), value.c_str(), 1) == 0);
+    SPP_FINISH(string("Cannot set environment variable: ") + name);
 }
 
 string GetEnv(const string & name, bool * ok)
 {
+    SPP_PROFILE(GetEnv);
     char * v = getenv(name.c_str());
     bool success = (v != nullptr);
     string ret = (v ? string(v) : string(""));
@@ -138,6 +556,7 @@ string GetEnv(const string & name, bool * ok)
 
 string Md5Sum(const string & message, bool * ok)
 {
+    SPP_PROFILE(Md5Sum);
     CryptoPP::Weak::MD5 hash;
     byte digest[ CryptoPP::Weak::MD5::DIGESTSIZE ];
     hash.CalculateDigest( digest, (byte*) message.c_str(), message.length() );
@@ -152,29 +571,34 @@ string Md5Sum(const string & message, bool * ok)
 
 string ReadFile(const string & filePath, bool * ok)
 {
+    SPP_PROFILE(ReadFile);
     string ret;
     bool success = false;
     ifstream ifs(filePath);
     if (ifs.is_open()) {
         ret = string( (istreambuf_iterator<char>(ifs)) , istreambuf_iterator<char>() );
         success = true;
+        sppProfile.AddRead(ret.size());
     }
     SPP_FINISH_WITH_RET(string("Cannot open file: ") + filePath);
 }
 
 void WriteFile(const string & filePath, const string & contents, bool * ok)
 {
+    SPP_PROFILE(WriteFile);
     bool success = false;
     ofstream ofs(filePath, ofstream::out | ofstream::trunc);
     if (ofs.is_open()) {
         ofs << contents;
         success = true;
+        sppProfile.AddWritten(contents.size());
     }
     SPP_FINISH(string("Cannot open file: ") + filePath);
 }
 
 int Execute(const string & command, bool * ok)
 {
+    SPP_PROFILE(Execute);
     int ret = system(command.c_str());
     bool success = (ret > -1);
     SPP_FINISH_WITH_RET(string("Cannot execute command: ") + command);
@@ -182,84 +606,173 @@ int Execute(const string & command, bool * ok)
 
 string GetCwd(bool * ok)
 {
+    SPP_PROFILE(GetCwd);
     string ret = current_path(sErrorCode).native();
     SPP_EC_FINISH_WITH_RET();
 }
 
 void ChDir(const string & dirPath, bool * ok)
 {
+    SPP_PROFILE(ChDir);
     current_path(dirPath, sErrorCode);
     SPP_EC_FINISH();
 }
 
 void MkDir(const string & dirPath, bool * ok)
 {
+    SPP_PROFILE(MkDir);
     create_directory(dirPath, sErrorCode);
     SPP_EC_FINISH();
 }
 
 void MkDirPath(const string & dirPath, bool * ok)
 {
+    SPP_PROFILE(MkDirPath);
     create_directories(dirPath, sErrorCode);
     SPP_EC_FINISH();
 }
 
 void Remove(const string & filePath, bool * ok)
 {
+    SPP_PROFILE(Remove);
     remove(filePath, sErrorCode);
     SPP_EC_FINISH();
 }
 
 void RemoveAll(const string & filePath, bool * ok)
 {
+    SPP_PROFILE(RemoveAll);
     remove_all(filePath, sErrorCode);
     SPP_EC_FINISH();
 }
 
 string BaseName(const string & filePath, bool * ok)
 {
+    SPP_PROFILE(BaseName);
     string ret = path(filePath).filename().native();
     SPP_EC_FINISH_WITH_RET();
 }
 
 string DirName(const string & filePath, bool * ok)
 {
+    SPP_PROFILE(DirName);
     string ret = path(filePath).parent_path().native();
     SPP_EC_FINISH_WITH_RET();
 }
 
-string AbsolutePath(const string & relPath, bool * ok)
+/// Normalizes a path in a single pass.
+/// Works on raw memory, so it never allocates. The output may alias
+/// the input, because the result is never longer than the input.
+/// For example (NormalizeAll):
+///
+///     path:              returns:
+///     ---------------------------
+///     //usr///lib/       /usr/lib
+///     /usr/./lib/../bin  /usr/bin
+///     /../usr            /usr
+///     ../a/./b/..        ../a
+///     a/..               .
+///
+/// @param out Buffer of at least `length` chars.
+/// @return The length of the normalized path written to `out`.
+size_t NormalizePath(const char * path, size_t length, char * out, unsigned flags)
 {
-    bool success = true;
-    string ret = absolute(path(relPath)).native();
+    SPP_PROFILE(NormalizePath);
+    const bool dots = (flags & NormalizeDots);
+    const bool slashes = dots || (flags & NormalizeSlashes);
+    const bool stripTrailing = (flags & NormalizeTrailingSlash);
 
-    // absolute() does not eliminate ".." directories.
-    // So, we have to do it ourselves.
-    // /a/b/../c --> /a/c
-    while (1) {
-        const auto dotdotPos = ret.find("/../");
-        if (dotdotPos == string::npos) {
-            break;
-        }
-        const auto prevDirPos = ret.find_last_of("/", dotdotPos - 1);
-        if (prevDirPos == string::npos) {
-            success = false;
-            SPP_FINISH_WITH_RET(string("Badly formatted path: ") + ret);
+    if (length == 0) {
+        return 0;
+    }
+    if (!slashes) {
+        memmove(out, path, length);
+        while (stripTrailing && length > 1 && out[length - 1] == '/') {
+            --length;
         }
-        ret.erase(prevDirPos, dotdotPos + 3 - prevDirPos);
+        return length;
     }
 
-    // absolute() does not eliminate "." directories.
-    // So, we have to do it ourselves.
-    // /a/b/./c --> /a/b/c
-    while (1) {
-        const auto dotPos = ret.find("/./");
-        if (dotPos == string::npos) {
+    const bool rooted = (path[0] == '/');
+    const bool trailing = (path[length - 1] == '/');
+    size_t w = 0;      // write position in out
+    size_t r = 0;      // read position in path
+    size_t depth = 0;  // segments in out that a ".." may remove
+
+    if (rooted) {
+        out[w++] = '/';
+    }
+    while (r < length) {
+        while (r < length && path[r] == '/') {
+            ++r;
+        }
+        const size_t segBegin = r;
+        while (r < length && path[r] != '/') {
+            ++r;
+        }
+        const size_t segLen = r - segBegin;
+        if (segLen == 0) {
             break;
         }
-        ret.erase(dotPos, 2);
+        if (dots && segLen == 1 && path[segBegin] == '.') {
+            continue;
+        }
+        if (dots && segLen == 2 && path[segBegin] == '.' && path[segBegin + 1] == '.') {
+            if (depth > 0) {
+                // Drop the last segment of out together with its separator.
+                while (w > 0 && out[w - 1] != '/') {
+                    --w;
+                }
+                if (w > 1 || (w == 1 && !rooted)) {
+                    --w;
+                }
+                --depth;
+                continue;
+            }
+            if (rooted) {
+                // "/.." is "/".
+                continue;
+            }
+        }
+        else {
+            ++depth;
+        }
+        if (w > 0 && out[w - 1] != '/') {
+            out[w++] = '/';
+        }
+        memmove(out + w, path + segBegin, segLen);
+        w += segLen;
     }
 
+    if (w == 0) {
+        // Everything cancelled out in a relative path.
+        out[w++] = '.';
+    }
+    else if (trailing && !stripTrailing && out[w - 1] != '/') {
+        out[w++] = '/';
+    }
+    return w;
+}
+
+string NormalizePath(const string & path, unsigned flags)
+{
+    SPP_PROFILE(NormalizePath);
+    string ret(path);
+    ret.resize(NormalizePath(ret.data(), ret.size(), &ret[0], flags));
+    return ret;
+}
+
+string AbsolutePath(const string & relPath, bool * ok)
+{
+    SPP_PROFILE(AbsolutePath);
+    // absolute() does not eliminate "." and ".." directories,
+    // so we have to do it ourselves.
+    // /a/b/../c --> /a/c
+    // /a/b/./c  --> /a/b/c
+    string ret = (!relPath.empty() && relPath[0] == '/')
+                 ? relPath
+                 : absolute(path(relPath)).native();
+    ret.resize(NormalizePath(ret.data(), ret.size(), &ret[0], NormalizeDots));
     SPP_EC_FINISH_WITH_RET();
 }
 
@@ -276,91 +789,111 @@ string AbsolutePath(const string & relPath, bool * ok)
 /// @return The path.
 string BuildPath(initializer_list<string> parts)
 {
+   SPP_PROFILE(BuildPath);
+   size_t len = 0;
+   for (const auto & part : parts)
+   {
+      len += part.size() + 1;
+   }
    string path;
-   auto len = parts.size();
+   path.reserve(len);
    auto it = begin(parts);
-   for (size_t i = 0; i < len; ++i, ++it)
+   for (size_t i = 0; i < parts.size(); ++i, ++it)
    {
       path.append(*it);
-      if (i != len - 1)
+      if (i != parts.size() - 1)
       {
          path.append("/");
       }
    }
-   return StripExtraSlashes(path);
+   return StripExtraSlashes(move(path));
 }
 
 bool Exists(const string & filePath, bool * ok)
 {
+    SPP_PROFILE(Exists);
     bool ret = exists(filePath, sErrorCode);
     SPP_EC_FINISH_WITH_RET();
 }
 
 bool IsDir(const string & dirPath, bool * ok)
 {
+    SPP_PROFILE(IsDir);
     bool ret = is_directory(dirPath, sErrorCode);
     SPP_EC_FINISH_WITH_RET();
 }
 
 bool IsRegularFile(const string & filePath, bool * ok)
 {
+    SPP_PROFILE(IsRegularFile);
     bool ret = is_regular_file(filePath, sErrorCode);
     SPP_EC_FINISH_WITH_RET();
 }
 
 bool IsFile(const string & filePath, bool * ok)
 {
+    SPP_PROFILE(IsFile);
     bool ret = is_regular_file(filePath, sErrorCode) || is_other(filePath, sErrorCode);
     SPP_EC_FINISH_WITH_RET();
 }
 
 bool IsSymlink(const string & filePath, bool * ok)
 {
+    SPP_PROFILE(IsSymlink);
     bool ret = is_symlink(filePath, sErrorCode);
     SPP_EC_FINISH_WITH_RET();
 }
 
 void Symlink(const string & to, const string & from, bool * ok)
 {
+    SPP_PROFILE(Symlink);
     create_symlink(to, from, sErrorCode);
     SPP_EC_FINISH();
 }
 
 string ReadLink(const string & filePath, bool * ok)
 {
+    SPP_PROFILE(ReadLink);
     string ret = read_symlink(filePath, sErrorCode).native();
     SPP_EC_FINISH_WITH_RET();
 }
 
 uintmax_t FileSize(const string & filePath, bool * ok)
 {
+    SPP_PROFILE(FileSize);
     auto ret = file_size(filePath, sErrorCode);
     SPP_EC_FINISH_WITH_RET();
 }
 
 string Owner(const string & path, bool * ok)
 {
+    SPP_PROFILE(Owner);
 }
 
 string Group(const string & path, bool * ok)
 {
+    SPP_PROFILE(Group);
 }
 
 string Permission(const string & path, bool * ok)
 {
+    SPP_PROFILE(Permission);
 }
 
 void ChMod(const string & path, const string & mode, bool recursive, bool * ok)
 {
+    SPP_PROFILE(ChMod);
     // do the recursive version with Find()!
 }
 
 void ChOwn(const string & path, const string & ownership, bool recursive, bool * ok)
 {
+    SPP_PROFILE(ChOwn);
 }
 
 void ChGrp(const string & path, const string & group, bool recursive, bool * ok)
 {
+    SPP_PROFILE(ChGrp);
 }
 
 vector<string> Find(const string & startPath,
@@ -368,16 +901,17 @@ vector<string> Find(const string & startPath,
                     size_t depth,
                     bool followSymlink)
 {
+    SPP_PROFILE(Find);
     vector<string> files;
     recursive_directory_iterator dirend;
     recursive_directory_iterator dit(startPath,
                                      followSymlink
                                      ? symlink_option::recurse
                                      : symlink_option::no_recurse);
-    while (++dit != dirend) {
+    for (; dit != dirend; ++dit) {
         if (depth == 0 || (depth > 0 && dit.level() <= depth)) {
-            path filePath = absolute((*dit).path(), startPath);
-            if (predicate(filePath.native())) {
+            path filePath = absolute((*dit).path());
+            if (CallUserCode(predicate, filePath.native())) {
                 files.push_back(filePath.native());
             }
         }
@@ -391,16 +925,17 @@ void FindAndDo(const string & startPath,
                int depth,
                bool followSymlink)
 {
+    SPP_PROFILE(FindAndDo);
     recursive_directory_iterator dirend;
     recursive_directory_iterator dit(startPath,
                                      followSymlink
                                      ? symlink_option::recurse
                                      : symlink_option::no_recurse);
-    while (++dit != dirend) {
+    for (; dit != dirend; ++dit) {
         if (depth == 0 || (depth > 0 && dit.level() <= depth)) {
-            path filePath = absolute((*dit).path(), startPath);
-            if (predicate(filePath.native())) {
-                if (!action(filePath.native())) {
+            path filePath = absolute((*dit).path());
+            if (CallUserCode(predicate, filePath.native())) {
+                if (!CallUserCode(action, filePath.native())) {
                     break;
                 }
             }
@@ -410,6 +945,2050 @@ void FindAndDo(const string & startPath,
 
 //####################################################################
 
+// Every worker owns a deque. It pushes and pops its own work at the back
+// and steals from the front of the others' deques when it runs dry.
+// Threads calling Run() help executing work until their own batch is done,
+// so Run() may be nested freely (e.g. ParallelFor inside ParallelFor).
+
+namespace
+{
+
+struct PoolBatch
+{
+    PoolBatch(size_t count, const function<void(size_t)> & task, bool userCode)
+        : task (task), userCode (userCode), remaining (count), failed (false) {}
+
+    const function<void(size_t)> & task;
+    bool userCode;      // submitted by the user, not by libscracc itself
+    atomic<size_t> remaining;
+    atomic<bool> failed;
+    exception_ptr error;
+    mutex doneMutex;
+    condition_variable done;
+};
+
+struct PoolItem
+{
+    PoolBatch * batch;
+    size_t index;
+};
+
+struct PoolQueue
+{
+    mutex m;
+    deque<PoolItem> items;
+};
+
+thread_local int tWorkerIndex = -1;
+thread_local const void * tWorkerPool = nullptr;
+
+unsigned AvailableCores()
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        return max(1, CPU_COUNT(&set));
+    }
+    return max(1u, thread::hardware_concurrency());
+}
+
+} // namespace anonymous
+
+struct ThreadPool::Impl
+{
+    Impl() : pending (0), stop (false) {}
+
+    vector<unique_ptr<PoolQueue> > queues;
+    vector<thread> workers;
+    atomic<size_t> pending;
+    bool stop;
+    mutex sleepMutex;
+    condition_variable wakeUp;
+
+    bool TryRunOne(int self);
+    void Execute(const PoolItem & item);
+    void WorkerLoop(int self);
+};
+
+bool ThreadPool::Impl::TryRunOne(int self)
+{
+    PoolItem item;
+    bool found = false;
+    if (self >= 0) {
+        PoolQueue & own = *queues[self];
+        lock_guard<mutex> lock(own.m);
+        if (!own.items.empty()) {
+            item = own.items.back();
+            own.items.pop_back();
+            found = true;
+        }
+    }
+    const size_t n = queues.size();
+    const size_t start = (self >= 0) ? self + 1 : 0;
+    for (size_t k = 0; !found && k < n; ++k) {
+        PoolQueue & victim = *queues[(start + k) % n];
+        lock_guard<mutex> lock(victim.m);
+        if (!victim.items.empty()) {
+            item = victim.items.front();
+            victim.items.pop_front();
+            found = true;
+        }
+    }
+    if (found) {
+        --pending;
+        Execute(item);
+    }
+    return found;
+}
+
+void ThreadPool::Impl::Execute(const PoolItem & item)
+{
+    PoolBatch & batch = *item.batch;
+    if (!batch.failed.load(memory_order_relaxed)) {
+        try {
+            if (batch.userCode) {
+                CallUserCode(batch.task, item.index);
+            }
+            else {
+                batch.task(item.index);
+            }
+        }
+        catch (...) {
+            lock_guard<mutex> lock(batch.doneMutex);
+            if (!batch.failed) {
+                batch.error = current_exception();
+                batch.failed = true;
+            }
+        }
+    }
+    // Decrement under the lock: Run() may return and destroy the batch
+    // as soon as it sees 0, so nothing may touch it after that.
+    lock_guard<mutex> lock(batch.doneMutex);
+    if (--batch.remaining == 0) {
+        batch.done.notify_all();
+    }
+}
+
+void ThreadPool::Impl::WorkerLoop(int self)
+{
+    tWorkerIndex = self;
+    tWorkerPool = this;
+    while (true) {
+        if (TryRunOne(self)) {
+            continue;
+        }
+        unique_lock<mutex> lock(sleepMutex);
+        wakeUp.wait(lock, [this]() { return stop || pending > 0; });
+        if (stop && pending == 0) {
+            return;
+        }
+    }
+}
+
+/// @param threads Number of worker threads, 0 means one per available core.
+ThreadPool::ThreadPool(unsigned threads)
+    : mImpl (new Impl)
+{
+    const unsigned count = threads ? threads : AvailableCores();
+    for (unsigned i = 0; i < count; ++i) {
+        mImpl->queues.emplace_back(new PoolQueue);
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        mImpl->workers.emplace_back(&Impl::WorkerLoop, mImpl.get(), int(i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(mImpl->sleepMutex);
+        mImpl->stop = true;
+    }
+    mImpl->wakeUp.notify_all();
+    for (auto & w : mImpl->workers) {
+        w.join();
+    }
+}
+
+unsigned ThreadPool::Size() const
+{
+    return mImpl->workers.size();
+}
+
+/// Runs task(0) ... task(count - 1) on the pool and waits for all of them.
+/// If a task throws, the tasks not started yet are skipped and the first
+/// exception is rethrown here.
+void ThreadPool::Run(size_t count, const function<void(size_t)> & task)
+{
+    SPP_PROFILE(ThreadPoolRun);
+    if (count == 0) {
+        return;
+    }
+    PoolBatch batch(count, task, sppProfile.IsRecording());
+    const int self = (tWorkerPool == mImpl.get()) ? tWorkerIndex : -1;
+    const size_t n = mImpl->queues.size();
+    for (size_t i = 0; i < count; ++i) {
+        // Keep nested work local, spread work from outside evenly.
+        PoolQueue & q = *mImpl->queues[self >= 0 ? self : i % n];
+        lock_guard<mutex> lock(q.m);
+        q.items.push_back(PoolItem { &batch, i });
+    }
+    {
+        lock_guard<mutex> lock(mImpl->sleepMutex);
+        mImpl->pending += count;
+    }
+    mImpl->wakeUp.notify_all();
+
+    while (batch.remaining > 0 && mImpl->TryRunOne(self)) {
+    }
+    // Whatever is left is being executed by other threads right now.
+    // Always take the lock, so the last Execute() is done with the batch.
+    {
+        unique_lock<mutex> lock(batch.doneMutex);
+        batch.done.wait(lock, [&batch]() { return batch.remaining == 0; });
+    }
+    if (batch.error) {
+        rethrow_exception(batch.error);
+    }
+}
+
+/// The pool used by the Parallel*() functions, sized to the available cores.
+ThreadPool & ThreadPool::Shared()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+//####################################################################
+
+namespace
+{
+
+/// Calls job(0) ... job(count - 1) on up to `threads` threads
+/// (0 means the shared pool). Stops handing out jobs after the first failure.
+/// @return false if any job returned false.
+bool RunOnWorkers(size_t count, unsigned threads, function<bool(size_t)> job)
+{
+    atomic<bool> failed(false);
+    if (threads == 0) {
+        ThreadPool::Shared().Run(count, [&](size_t i) {
+            if (!failed && !job(i)) {
+                failed = true;
+            }
+        });
+        return !failed;
+    }
+    const unsigned threadCount = max(1u, min<unsigned>(threads, count));
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        size_t i;
+        while (!failed && (i = next++) < count) {
+            if (!job(i)) {
+                failed = true;
+            }
+        }
+    };
+    vector<thread> workers;
+    for (unsigned t = 1; t < threadCount; ++t) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+    return !failed;
+}
+
+struct TreeEntry
+{
+    string relPath;
+    string fullPath;
+    string linkTarget;
+    struct stat st;
+    string digest;
+    bool cached;
+};
+
+/// Streams a file through MD5 without loading it into memory.
+bool HashFileContents(const string & filePath, string & digest)
+{
+    const int fd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    CryptoPP::Weak::MD5 hash;
+    vector<byte> buf(256 * 1024);
+    bool success = true;
+    while (true) {
+        const ssize_t n = read(fd, buf.data(), buf.size());
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            success = false;
+            break;
+        }
+        hash.Update(buf.data(), n);
+    }
+    close(fd);
+    byte d[ CryptoPP::Weak::MD5::DIGESTSIZE ];
+    hash.Final(d);
+    digest.assign(reinterpret_cast<const char *>(d), sizeof(d));
+    return success;
+}
+
+int64_t NanoTime(const struct timespec & ts)
+{
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/// Cache file format, one regular file per line:
+///
+///     <hex digest> <dev> <ino> <size> <mtime ns> <ctime ns> <relative path>
+///
+map<string, pair<string, string> > LoadHashCache(const string & cacheFile)
+{
+    map<string, pair<string, string> > cache;
+    std::ifstream ifs(cacheFile);
+    string line;
+    while (getline(ifs, line)) {
+        // Skip anything that is not 32 hex digits and a space.
+        if (line.size() < 33 || line[32] != ' '
+            || line.find_first_not_of("0123456789ABCDEFabcdef") != 32) {
+            continue;
+        }
+        // The first six fields form the stat key.
+        size_t pos = 0;
+        for (int i = 0; i < 6 && pos != string::npos; ++i) {
+            pos = line.find(' ', pos + 1);
+        }
+        if (pos == string::npos) {
+            continue;
+        }
+        cache[line.substr(pos + 1)] = make_pair(line.substr(33, pos - 33),
+                                                line.substr(0, 32));
+    }
+    return cache;
+}
+
+string StatKey(const struct stat & st)
+{
+    ostringstream oss;
+    oss << st.st_dev << ' ' << st.st_ino << ' ' << st.st_size << ' '
+        << NanoTime(st.st_mtim) << ' ' << NanoTime(st.st_ctim);
+    return oss.str();
+}
+
+string ToHex(const string & bytes)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    string hex;
+    hex.reserve(bytes.size() * 2);
+    for (unsigned char c : bytes) {
+        hex.push_back(digits[c >> 4]);
+        hex.push_back(digits[c & 0xf]);
+    }
+    return hex;
+}
+
+int HexDigit(char c)
+{
+    return (c >= '0' && c <= '9') ? c - '0'
+           : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+           : (c >= 'A' && c <= 'F') ? c - 'A' + 10
+           : 0;
+}
+
+/// @param hex Hex digits, as checked by LoadHashCache().
+string FromHex(const string & hex)
+{
+    string bytes;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+        bytes.push_back(char(HexDigit(hex[i]) << 4 | HexDigit(hex[i + 1])));
+    }
+    return bytes;
+}
+
+} // namespace anonymous
+
+/// Hashes a whole directory tree into a single digest.
+/// File contents are hashed in parallel with streaming reads. Each entry
+/// contributes a leaf digest over its type, mode, size, relative path and
+/// contents (or link target); the leaves are combined in path order, so the
+/// result only depends on what is in the tree, not on traversal order.
+/// Owners and timestamps are not part of the digest.
+///
+/// With options.cacheFile set, the content digests are remembered keyed by
+/// device, inode, size, mtime and ctime, and files whose stat data did not
+/// change are not read again on later runs.
+///
+/// @return The hex encoded digest of the tree.
+string HashTree(const string & rootPath, const HashTreeOptions & options, bool * ok)
+{
+    SPP_PROFILE(HashTree);
+    bool success = true;
+    string ret;
+    const string root = NormalizePath(rootPath, NormalizeAll);
+
+    // Collect the entries. The walk itself is cheap compared to hashing.
+    vector<TreeEntry> entries;
+    try {
+        recursive_directory_iterator dirend;
+        recursive_directory_iterator dit(root,
+                                         options.followSymlink
+                                         ? symlink_option::recurse
+                                         : symlink_option::no_recurse);
+        for (; dit != dirend; ++dit) {
+            TreeEntry e;
+            e.fullPath = (*dit).path().native();
+            e.relPath = e.fullPath.substr(min(root.size(), e.fullPath.size()));
+            e.relPath.erase(0, e.relPath.find_first_not_of('/'));
+            e.cached = false;
+            const int r = options.followSymlink
+                          ? stat(e.fullPath.c_str(), &e.st)
+                          : lstat(e.fullPath.c_str(), &e.st);
+            if (r != 0) {
+                success = false;
+                break;
+            }
+            if (S_ISLNK(e.st.st_mode)) {
+                e.linkTarget = read_symlink(e.fullPath).native();
+            }
+            entries.push_back(move(e));
+        }
+    }
+    catch (filesystem_error &) {
+        success = false;
+    }
+    if (!success) {
+        SPP_FINISH_WITH_RET(string("Cannot walk directory: ") + rootPath);
+    }
+    sort(begin(entries), end(entries),
+         [](const TreeEntry & a, const TreeEntry & b) { return a.relPath < b.relPath; });
+
+    // Reuse cached digests of files that look unchanged.
+    vector<size_t> toHash;
+    if (!options.cacheFile.empty()) {
+        const auto cache = LoadHashCache(options.cacheFile);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            TreeEntry & e = entries[i];
+            if (!S_ISREG(e.st.st_mode)) {
+                continue;
+            }
+            const auto it = cache.find(e.relPath);
+            if (it != cache.end() && it->second.first == StatKey(e.st)) {
+                e.digest = FromHex(it->second.second);
+                e.cached = true;
+            }
+            else {
+                toHash.push_back(i);
+            }
+        }
+    }
+    else {
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (S_ISREG(entries[i].st.st_mode)) {
+                toHash.push_back(i);
+            }
+        }
+    }
+
+    // Hash the rest on all cores.
+    success = RunOnWorkers(toHash.size(), options.threads, [&](size_t i) {
+        TreeEntry & e = entries[toHash[i]];
+        return HashFileContents(e.fullPath, e.digest);
+    });
+    for (size_t i = 0; sProfile && i < toHash.size(); ++i) {
+        sppProfile.AddRead(entries[toHash[i]].st.st_size);
+    }
+    if (!success) {
+        SPP_FINISH_WITH_RET(string("Cannot read files under: ") + rootPath);
+    }
+
+    // Combine the leaves.
+    CryptoPP::Weak::MD5 treeHash;
+    for (const auto & e : entries) {
+        ostringstream leaf;
+        leaf << (S_ISDIR(e.st.st_mode) ? 'd' : S_ISLNK(e.st.st_mode) ? 'l'
+                 : S_ISREG(e.st.st_mode) ? 'f' : 'o')
+             << ' ' << oct << (e.st.st_mode & 07777) << dec
+             << ' ' << (S_ISREG(e.st.st_mode) ? uintmax_t(e.st.st_size) : 0)
+             << ' ' << e.relPath << '\0' << e.digest << e.linkTarget;
+        const string leafData = leaf.str();
+        byte d[ CryptoPP::Weak::MD5::DIGESTSIZE ];
+        CryptoPP::Weak::MD5().CalculateDigest(d, (const byte *) leafData.data(), leafData.size());
+        treeHash.Update(d, sizeof(d));
+    }
+    byte d[ CryptoPP::Weak::MD5::DIGESTSIZE ];
+    treeHash.Final(d);
+    ret = ToHex(string(reinterpret_cast<const char *>(d), sizeof(d)));
+
+    // Files touched within the last two seconds could still change without
+    // their mtime moving, so those are never cached.
+    if (!options.cacheFile.empty()) {
+        const int64_t recent = int64_t(time(nullptr) - 2) * 1000000000;
+        ostringstream cache;
+        for (const auto & e : entries) {
+            if (S_ISREG(e.st.st_mode) && NanoTime(e.st.st_mtim) < recent
+                && e.relPath.find('\n') == string::npos) {
+                cache << ToHex(e.digest) << ' ' << StatKey(e.st) << ' ' << e.relPath << '\n';
+            }
+        }
+        // Unique per process and call, so concurrent runs sharing the cache
+        // never write into the same file; the last rename() wins whole.
+        static atomic<unsigned> sTmpCounter(0);
+        const string tmpFile = options.cacheFile + ".tmp." + to_string(getpid())
+                               + "." + to_string(sTmpCounter++);
+        WriteFile(tmpFile, cache.str(), &success);
+        if (success) {
+            rename(tmpFile, options.cacheFile, sErrorCode);
+            success = !sErrorCode;
+        }
+        if (!success) {
+            ::unlink(tmpFile.c_str());
+        }
+        SPP_FINISH_WITH_RET(string("Cannot write hash cache: ") + options.cacheFile);
+    }
+
+    SPP_FINISH_WITH_RET("");
+}
+
+//####################################################################
+
+namespace
+{
+
+/// Copies `size` bytes between two open files without going through
+/// user space when the kernel allows it: reflink first, then
+/// copy_file_range(), then sendfile(), then plain read()/write().
+bool CopyFileData(int in, int out, off_t size)
+{
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) {
+        return true;
+    }
+#endif
+    off_t done = 0;
+    bool tryCopyRange = true;
+    bool trySendfile = true;
+    vector<char> buf;
+    while (done < size) {
+        ssize_t n = -1;
+        if (tryCopyRange) {
+            n = copy_file_range(in, nullptr, out, nullptr, size - done, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+                          || errno == EOPNOTSUPP)) {
+                tryCopyRange = false;
+                continue;
+            }
+        }
+        else if (trySendfile) {
+            n = sendfile(out, in, nullptr, size - done);
+            if (n < 0 && (errno == ENOSYS || errno == EINVAL)) {
+                trySendfile = false;
+                continue;
+            }
+        }
+        else {
+            buf.resize(256 * 1024);
+            n = read(in, buf.data(), buf.size());
+            ssize_t written = 0;
+            while (n > 0 && written < n) {
+                const ssize_t m = write(out, buf.data() + written, n - written);
+                if (m < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                written += m;
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            // The source shrank while copying.
+            break;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/// @param copied If not null, set to the number of bytes copied.
+bool CopyOneFile(const string & from, const string & to, bool preserveMetadata,
+                 uint64_t * copied = nullptr)
+{
+    const int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        close(in);
+        return false;
+    }
+    // Truncate only after making sure this is not the source itself
+    // (same path or a hard link), which would wipe the data.
+    const int out = open(to.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, st.st_mode & 07777);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+    struct stat outSt;
+    if (fstat(out, &outSt) != 0
+        || (outSt.st_dev == st.st_dev && outSt.st_ino == st.st_ino)
+        || ftruncate(out, 0) != 0) {
+        close(in);
+        close(out);
+        return false;
+    }
+    bool success = CopyFileData(in, out, st.st_size);
+    if (success && preserveMetadata) {
+        // Changing the owner needs privileges, so that one is best effort.
+        if (fchown(out, st.st_uid, st.st_gid) != 0) {
+            fchown(out, -1, st.st_gid);
+        }
+        const struct timespec times[2] = { st.st_atim, st.st_mtim };
+        success = (fchmod(out, st.st_mode & 07777) == 0)
+                  && (futimens(out, times) == 0);
+    }
+    close(in);
+    success = (close(out) == 0) && success;
+    if (success && copied) {
+        *copied = st.st_size;
+    }
+    return success;
+}
+
+bool CopyMetadata(const string & from, const string & to)
+{
+    struct stat st;
+    if (lstat(from.c_str(), &st) != 0) {
+        return false;
+    }
+    if (lchown(to.c_str(), st.st_uid, st.st_gid) != 0) {
+        lchown(to.c_str(), -1, st.st_gid);
+    }
+    const struct timespec times[2] = { st.st_atim, st.st_mtim };
+    return (S_ISLNK(st.st_mode) || chmod(to.c_str(), st.st_mode & 07777) == 0)
+           && utimensat(AT_FDCWD, to.c_str(), times, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+/// Recreates a fifo, socket or device node with mknod().
+/// Device nodes need privileges.
+bool CopySpecialFile(const string & from, const string & to)
+{
+    struct stat st;
+    return lstat(from.c_str(), &st) == 0
+           && mknod(to.c_str(), st.st_mode, st.st_rdev) == 0;
+}
+
+/// Does the work of CopyTree(), see there.
+/// @param copySpecial Recreate fifos, sockets and device nodes instead of
+///                    skipping them, and fail if that is not possible.
+/// @param copied Set to the number of file bytes copied.
+bool CopyWholeTree(const string & from, const string & to, bool preserveMetadata,
+                   bool copySpecial, uint64_t & copied)
+{
+    bool success = true;
+    vector<pair<string, string> > files;
+    vector<pair<string, string> > dirs;
+    const string root = NormalizePath(from, NormalizeAll);
+    copied = 0;
+    try {
+        create_directories(to);
+        dirs.push_back(make_pair(root, to));
+        recursive_directory_iterator dirend;
+        for (recursive_directory_iterator dit(root); dit != dirend; ++dit) {
+            const string src = (*dit).path().native();
+            const string dst = BuildPath( { to, src.substr(root.size()) } );
+            const auto status = (*dit).symlink_status();
+            if (is_symlink(status)) {
+                create_symlink(read_symlink(src), dst);
+                if (preserveMetadata) {
+                    CopyMetadata(src, dst);
+                }
+            }
+            else if (is_directory(status)) {
+                create_directory(dst);
+                dirs.push_back(make_pair(src, dst));
+            }
+            else if (is_regular_file(status)) {
+                files.push_back(make_pair(src, dst));
+            }
+            else if (copySpecial) {
+                if (!CopySpecialFile(src, dst)
+                    || (preserveMetadata && !CopyMetadata(src, dst))) {
+                    success = false;
+                    break;
+                }
+            }
+        }
+    }
+    catch (filesystem_error &) {
+        success = false;
+    }
+    if (success) {
+        atomic<uint64_t> total(0);
+        success = RunOnWorkers(files.size(), 0, [&](size_t i) {
+            uint64_t bytes = 0;
+            const bool ret = CopyOneFile(files[i].first, files[i].second,
+                                         preserveMetadata, &bytes);
+            total += bytes;
+            return ret;
+        });
+        copied = total;
+    }
+    // Directory times change while filling them, so they go last,
+    // deepest first.
+    if (success && preserveMetadata) {
+        for (auto it = dirs.rbegin(); success && it != dirs.rend(); ++it) {
+            success = CopyMetadata(it->first, it->second);
+        }
+    }
+    return success;
+}
+
+} // namespace anonymous
+
+/// Copies a single file.
+/// Data is copied inside the kernel (reflink, copy_file_range() or
+/// sendfile()) whenever possible.
+/// @param preserveMetadata Also copy mode, ownership and timestamps.
+void CopyFile(const string & from, const string & to, bool preserveMetadata, bool * ok)
+{
+    SPP_PROFILE(CopyFile);
+    uint64_t copied = 0;
+    bool success = CopyOneFile(from, to, preserveMetadata, &copied);
+    sppProfile.AddRead(copied);
+    sppProfile.AddWritten(copied);
+    SPP_FINISH(string("Cannot copy file: ") + from + " -> " + to);
+}
+
+/// Copies a directory tree.
+/// Directories and symlinks are recreated first, then the regular files
+/// are copied by parallel workers, each with CopyFile().
+/// Other file types (devices, fifos, sockets) are skipped.
+/// @param preserveMetadata Also copy mode, ownership and timestamps.
+void CopyTree(const string & from, const string & to, bool preserveMetadata, bool * ok)
+{
+    SPP_PROFILE(CopyTree);
+    // Like cp -r, refuse to copy a directory into itself; the walk would
+    // keep finding the copies it just made.
+    const string fromAbs = NormalizePath(AbsolutePath(from), NormalizeAll);
+    const string toAbs = NormalizePath(AbsolutePath(to), NormalizeAll);
+    bool success = !(toAbs == fromAbs
+                     || (toAbs.compare(0, fromAbs.size(), fromAbs) == 0
+                         && (fromAbs == "/" || toAbs[fromAbs.size()] == '/')));
+    if (!success) {
+        SPP_FINISH(string("Cannot copy a directory into itself: ") + from + " -> " + to);
+        return;
+    }
+    uint64_t copied = 0;
+    success = CopyWholeTree(from, to, preserveMetadata, false, copied);
+    sppProfile.AddRead(copied);
+    sppProfile.AddWritten(copied);
+    SPP_FINISH(string("Cannot copy tree: ") + from + " -> " + to);
+}
+
+/// Moves a file or directory tree.
+/// This is a rename() on the same filesystem. Across filesystems the tree
+/// is copied with its metadata, symlinks and special files included, and
+/// the source is only removed if all of it could be reproduced.
+void MoveTree(const string & from, const string & to, bool * ok)
+{
+    SPP_PROFILE(MoveTree);
+    bool success = (::rename(from.c_str(), to.c_str()) == 0);
+    if (!success && errno == EXDEV) {
+        // The source is removed afterwards, so everything in it has to be
+        // reproduced, not just what CopyTree() handles.
+        uint64_t copied = 0;
+        const auto status = symlink_status(from, sErrorCode);
+        if (sErrorCode) {
+            success = false;
+        }
+        else if (is_symlink(status)) {
+            const auto target = read_symlink(from, sErrorCode);
+            if (!sErrorCode) {
+                create_symlink(target, to, sErrorCode);
+            }
+            success = !sErrorCode && CopyMetadata(from, to);
+        }
+        else if (is_directory(status)) {
+            success = CopyWholeTree(from, to, true, true, copied);
+        }
+        else if (is_regular_file(status)) {
+            success = CopyOneFile(from, to, true, &copied);
+        }
+        else {
+            success = CopySpecialFile(from, to) && CopyMetadata(from, to);
+        }
+        sppProfile.AddRead(copied);
+        sppProfile.AddWritten(copied);
+        if (success) {
+            remove_all(from, sErrorCode);
+            success = !sErrorCode;
+        }
+    }
+    SPP_FINISH(string("Cannot move: ") + from + " -> " + to);
+}
+
+//####################################################################
+
+namespace
+{
+
+bool ReadWholeFile(const string & filePath, string & contents)
+{
+    const int fd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    contents.clear();
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        contents.reserve(st.st_size);
+    }
+    char buf[64 * 1024];
+    bool success = true;
+    while (true) {
+        const ssize_t n = read(fd, buf, sizeof(buf));
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            success = false;
+            break;
+        }
+        contents.append(buf, n);
+    }
+    close(fd);
+    return success;
+}
+
+bool WriteAll(int fd, const char * data, size_t size)
+{
+    while (size > 0) {
+        const ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool PWriteAll(int fd, const char * data, size_t size, off_t offset)
+{
+    while (size > 0) {
+        const ssize_t n = pwrite(fd, data, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+bool WriteWholeFile(const string & filePath, const string & contents)
+{
+    const int fd = open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        return false;
+    }
+    bool success = WriteAll(fd, contents.data(), contents.size());
+    success = (close(fd) == 0) && success;
+    return success;
+}
+
+#ifdef HAS_IO_URING
+
+/// Minimal io_uring wrapper on top of the raw system calls.
+/// Only what the batch file functions need: get SQEs, submit them and
+/// reap the completions.
+class Uring
+{
+public:
+    explicit Uring(unsigned entries);
+    ~Uring();
+    bool IsUsable() const { return mUsable; }
+    io_uring_sqe * GetSqe();
+    /// Submits the queued SQEs and calls onCqe(userData, result) for each
+    /// of the `expected` completions.
+    bool Run(unsigned expected, function<void(uint64_t, int)> onCqe);
+private:
+    int mFd;
+    bool mUsable;
+    io_uring_params mParams;
+    void * mSqRing;
+    size_t mSqRingSize;
+    void * mCqRing;
+    size_t mCqRingSize;
+    io_uring_sqe * mSqes;
+    unsigned * mSqHead;
+    unsigned * mSqTail;
+    unsigned * mSqMask;
+    unsigned * mSqArray;
+    unsigned * mCqHead;
+    unsigned * mCqTail;
+    unsigned * mCqMask;
+    io_uring_cqe * mCqes;
+    unsigned mSqeTail;
+    unsigned mSubmitted;
+};
+
+Uring::Uring(unsigned entries)
+    :  mFd (-1)
+      ,mUsable (false)
+      ,mSqRing (MAP_FAILED)
+      ,mSqRingSize (0)
+      ,mCqRing (MAP_FAILED)
+      ,mCqRingSize (0)
+      ,mSqes (static_cast<io_uring_sqe *>(MAP_FAILED))
+      ,mSqeTail (0)
+      ,mSubmitted (0)
+{
+    memset(&mParams, 0, sizeof(mParams));
+    mFd = syscall(__NR_io_uring_setup, entries, &mParams);
+    if (mFd < 0) {
+        // Too old kernel, or forbidden by seccomp or sysctl.
+        return;
+    }
+    mSqRingSize = mParams.sq_off.array + mParams.sq_entries * sizeof(unsigned);
+    mCqRingSize = mParams.cq_off.cqes + mParams.cq_entries * sizeof(io_uring_cqe);
+    if (mParams.features & IORING_FEAT_SINGLE_MMAP) {
+        mSqRingSize = mCqRingSize = max(mSqRingSize, mCqRingSize);
+    }
+    mSqRing = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+    if (mSqRing == MAP_FAILED) {
+        return;
+    }
+    if (mParams.features & IORING_FEAT_SINGLE_MMAP) {
+        mCqRing = mSqRing;
+    }
+    else {
+        mCqRing = mmap(nullptr, mCqRingSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+        if (mCqRing == MAP_FAILED) {
+            return;
+        }
+    }
+    mSqes = static_cast<io_uring_sqe *>(
+                mmap(nullptr, mParams.sq_entries * sizeof(io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     mFd, IORING_OFF_SQES));
+    if (mSqes == MAP_FAILED) {
+        return;
+    }
+    char * sq = static_cast<char *>(mSqRing);
+    char * cq = static_cast<char *>(mCqRing);
+    mSqHead = reinterpret_cast<unsigned *>(sq + mParams.sq_off.head);
+    mSqTail = reinterpret_cast<unsigned *>(sq + mParams.sq_off.tail);
+    mSqMask = reinterpret_cast<unsigned *>(sq + mParams.sq_off.ring_mask);
+    mSqArray = reinterpret_cast<unsigned *>(sq + mParams.sq_off.array);
+    mCqHead = reinterpret_cast<unsigned *>(cq + mParams.cq_off.head);
+    mCqTail = reinterpret_cast<unsigned *>(cq + mParams.cq_off.tail);
+    mCqMask = reinterpret_cast<unsigned *>(cq + mParams.cq_off.ring_mask);
+    mCqes = reinterpret_cast<io_uring_cqe *>(cq + mParams.cq_off.cqes);
+    mSqeTail = mSubmitted = *mSqTail;
+
+    // The opcodes we use arrived in different kernel versions.
+    const size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    vector<char> probeBuf(probeSize, 0);
+    io_uring_probe * probe = reinterpret_cast<io_uring_probe *>(probeBuf.data());
+    if (syscall(__NR_io_uring_register, mFd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        return;
+    }
+    mUsable = true;
+    for (int op : { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                    IORING_OP_WRITE, IORING_OP_CLOSE }) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            mUsable = false;
+        }
+    }
+}
+
+Uring::~Uring()
+{
+    if (mSqes != MAP_FAILED) {
+        munmap(mSqes, mParams.sq_entries * sizeof(io_uring_sqe));
+    }
+    if (mCqRing != MAP_FAILED && mCqRing != mSqRing) {
+        munmap(mCqRing, mCqRingSize);
+    }
+    if (mSqRing != MAP_FAILED) {
+        munmap(mSqRing, mSqRingSize);
+    }
+    if (mFd >= 0) {
+        close(mFd);
+    }
+}
+
+io_uring_sqe * Uring::GetSqe()
+{
+    const unsigned head = __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+    if (mSqeTail - head >= mParams.sq_entries) {
+        return nullptr;
+    }
+    const unsigned index = mSqeTail & *mSqMask;
+    io_uring_sqe * sqe = &mSqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    mSqArray[index] = index;
+    ++mSqeTail;
+    return sqe;
+}
+
+bool Uring::Run(unsigned expected, function<void(uint64_t, int)> onCqe)
+{
+    __atomic_store_n(mSqTail, mSqeTail, __ATOMIC_RELEASE);
+    unsigned reaped = 0;
+    while (reaped < expected) {
+        const unsigned toSubmit = mSqeTail - mSubmitted;
+        const int n = syscall(__NR_io_uring_enter, mFd, toSubmit, 1,
+                              IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            return false;
+        }
+        mSubmitted += n;
+        unsigned head = *mCqHead;
+        const unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, ++reaped) {
+            const io_uring_cqe & cqe = mCqes[head & *mCqMask];
+            onCqe(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+/// Closes the files still open in a window, for when the ring fails midway.
+void CloseAll(vector<int> & fds)
+{
+    for (int & fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+}
+
+/// Reads the files in windows: one round of open+statx, one round of
+/// reads and one round of closes, each submitted as a single batch.
+/// @return false if io_uring cannot be used at all.
+bool UringReadFiles(const vector<string> & filePaths, vector<string> & contents,
+                    vector<char> & done)
+{
+    const unsigned kWindow = 128;
+    const uint64_t kMaxReadSize = 1 << 30;
+    Uring ring(2 * kWindow);
+    if (!ring.IsUsable()) {
+        return false;
+    }
+    vector<int> fds(kWindow);
+    vector<struct statx> stats(kWindow);
+    for (size_t first = 0; first < filePaths.size(); first += kWindow) {
+        const unsigned count = min<size_t>(kWindow, filePaths.size() - first);
+        fill(fds.begin(), fds.end(), -1);
+
+        for (unsigned i = 0; i < count; ++i) {
+            io_uring_sqe * sqe = ring.GetSqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(filePaths[first + i].c_str());
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe->user_data = 2 * i;
+            sqe = ring.GetSqe();
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(filePaths[first + i].c_str());
+            sqe->len = STATX_SIZE;
+            sqe->off = reinterpret_cast<uint64_t>(&stats[i]);
+            sqe->user_data = 2 * i + 1;
+        }
+        vector<char> statOk(count, 0);
+        if (!ring.Run(2 * count, [&](uint64_t data, int res) {
+                if (data % 2 == 0) {
+                    fds[data / 2] = res;
+                }
+                else {
+                    statOk[data / 2] = (res == 0);
+                }
+            })) {
+            CloseAll(fds);
+            return false;
+        }
+
+        unsigned reads = 0;
+        for (unsigned i = 0; i < count; ++i) {
+            if (fds[i] < 0 || !statOk[i] || stats[i].stx_size == 0
+                || stats[i].stx_size > kMaxReadSize) {
+                // Leave failures, huge files and files without a size
+                // (like /proc) to the synchronous path.
+                continue;
+            }
+            contents[first + i].resize(stats[i].stx_size);
+            io_uring_sqe * sqe = ring.GetSqe();
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fds[i];
+            sqe->addr = reinterpret_cast<uint64_t>(&contents[first + i][0]);
+            sqe->len = stats[i].stx_size;
+            sqe->off = 0;
+            sqe->user_data = i;
+            ++reads;
+        }
+        if (!ring.Run(reads, [&](uint64_t i, int res) {
+                // Short reads are finished synchronously below.
+                if (res >= 0 && size_t(res) == contents[first + i].size()) {
+                    done[first + i] = 1;
+                }
+            })) {
+            CloseAll(fds);
+            return false;
+        }
+
+        unsigned closes = 0;
+        for (unsigned i = 0; i < count; ++i) {
+            if (fds[i] >= 0) {
+                io_uring_sqe * sqe = ring.GetSqe();
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = fds[i];
+                sqe->user_data = i;
+                ++closes;
+            }
+        }
+        if (!ring.Run(closes, [&](uint64_t i, int) { fds[i] = -1; })) {
+            CloseAll(fds);
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Same as UringReadFiles(): batched opens, writes and closes.
+bool UringWriteFiles(const vector<pair<string, string> > & files, vector<char> & done)
+{
+    const unsigned kWindow = 128;
+    Uring ring(kWindow);
+    if (!ring.IsUsable()) {
+        return false;
+    }
+    vector<int> fds(kWindow);
+    for (size_t first = 0; first < files.size(); first += kWindow) {
+        const unsigned count = min<size_t>(kWindow, files.size() - first);
+        fill(fds.begin(), fds.end(), -1);
+
+        for (unsigned i = 0; i < count; ++i) {
+            io_uring_sqe * sqe = ring.GetSqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(files[first + i].first.c_str());
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+            sqe->len = 0666;
+            sqe->user_data = i;
+        }
+        if (!ring.Run(count, [&](uint64_t i, int res) { fds[i] = res; })) {
+            CloseAll(fds);
+            return false;
+        }
+
+        unsigned writes = 0;
+        for (unsigned i = 0; i < count; ++i) {
+            const string & data = files[first + i].second;
+            if (fds[i] < 0) {
+                continue;
+            }
+            if (data.empty()) {
+                done[first + i] = 1;
+                continue;
+            }
+            io_uring_sqe * sqe = ring.GetSqe();
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = fds[i];
+            sqe->addr = reinterpret_cast<uint64_t>(data.data());
+            sqe->len = data.size();
+            sqe->off = 0;
+            sqe->user_data = i;
+            ++writes;
+        }
+        if (!ring.Run(writes, [&](uint64_t i, int res) {
+                const string & data = files[first + i].second;
+                if (res >= 0 && size_t(res) < data.size()) {
+                    // Short write, finish it synchronously. The write was
+                    // positional, so the file offset is still at 0.
+                    res = PWriteAll(fds[i], data.data() + res, data.size() - res, res)
+                          ? data.size() : -1;
+                }
+                done[first + i] = (res >= 0);
+            })) {
+            CloseAll(fds);
+            return false;
+        }
+
+        unsigned closes = 0;
+        for (unsigned i = 0; i < count; ++i) {
+            if (fds[i] >= 0) {
+                io_uring_sqe * sqe = ring.GetSqe();
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = fds[i];
+                sqe->user_data = i;
+                ++closes;
+            }
+        }
+        if (!ring.Run(closes, [&](uint64_t i, int res) {
+                fds[i] = -1;
+                if (res < 0) {
+                    done[first + i] = 0;
+                }
+            })) {
+            CloseAll(fds);
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif // HAS_IO_URING
+
+} // namespace anonymous
+
+/// Reads many files at once.
+/// Uses batched io_uring submissions when the kernel supports them and
+/// a pool of worker threads otherwise.
+/// Files that cannot be read come back as empty strings and make the
+/// whole call fail.
+/// @return The contents, in the order of filePaths.
+vector<string> ReadFiles(const vector<string> & filePaths, bool * ok)
+{
+    SPP_PROFILE(ReadFiles);
+    vector<string> ret(filePaths.size());
+    vector<char> done(filePaths.size(), 0);
+#ifdef HAS_IO_URING
+    UringReadFiles(filePaths, ret, done);
+#endif
+    // Whatever io_uring did not finish (or everything, without io_uring).
+    vector<size_t> rest;
+    for (size_t i = 0; i < filePaths.size(); ++i) {
+        if (!done[i]) {
+            rest.push_back(i);
+        }
+    }
+    atomic<size_t> failed(filePaths.size());
+    RunOnWorkers(rest.size(), 0, [&](size_t i) {
+        if (!ReadWholeFile(filePaths[rest[i]], ret[rest[i]])) {
+            ret[rest[i]].clear();
+            failed = rest[i];
+        }
+        return true;
+    });
+    bool success = (failed == filePaths.size());
+    for (size_t i = 0; sProfile && i < ret.size(); ++i) {
+        sppProfile.AddRead(ret[i].size());
+    }
+    SPP_FINISH_WITH_RET(string("Cannot read file: ") + (success ? "" : filePaths[failed.load()]));
+}
+
+/// Writes many files at once, see ReadFiles().
+/// @param files (path, contents) pairs.
+void WriteFiles(const vector<pair<string, string> > & files, bool * ok)
+{
+    SPP_PROFILE(WriteFiles);
+    vector<char> done(files.size(), 0);
+#ifdef HAS_IO_URING
+    UringWriteFiles(files, done);
+#endif
+    vector<size_t> rest;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!done[i]) {
+            rest.push_back(i);
+        }
+    }
+    atomic<size_t> failed(files.size());
+    RunOnWorkers(rest.size(), 0, [&](size_t i) {
+        if (!WriteWholeFile(files[rest[i]].first, files[rest[i]].second)) {
+            failed = rest[i];
+        }
+        return true;
+    });
+    bool success = (failed == files.size());
+    for (size_t i = 0; sProfile && i < files.size(); ++i) {
+        sppProfile.AddWritten(files[i].second.size());
+    }
+    SPP_FINISH(string("Cannot write file: ") + (success ? "" : files[failed.load()].first));
+}
+
+/// Runs ReadFiles() in the background.
+/// Errors are reported by the future's get(), following SetThrowExceptions().
+future<vector<string> > ReadFilesAsync(const vector<string> & filePaths)
+{
+    SPP_PROFILE(ReadFilesAsync);
+    return async(launch::async, [filePaths]() { return ReadFiles(filePaths); });
+}
+
+/// Runs WriteFiles() in the background, see ReadFilesAsync().
+future<void> WriteFilesAsync(const vector<pair<string, string> > & files)
+{
+    SPP_PROFILE(WriteFilesAsync);
+    return async(launch::async, [files]() { WriteFiles(files); });
+}
+
+//####################################################################
+
+// Store file layout:
+//
+//     header:  "SCRSTORE" | u64 committed end offset | padding to 64 bytes
+//     records: u32 key length | u32 value length (~0 = erased)
+//              | u64 checksum | key | value | padding to 8 bytes
+//
+// Records are only appended. A record becomes visible when the committed
+// offset in the header moves past it, and that only happens after the
+// record itself has reached the disk. A crash can at worst lose the record
+// being written.
+
+namespace
+{
+
+const char kStoreMagic[8] = { 'S', 'C', 'R', 'S', 'T', 'O', 'R', 'E' };
+const uint64_t kStoreHeaderSize = 64;
+const uint64_t kStoreCommittedOffset = 8;
+const uint32_t kStoreErased = ~uint32_t(0);
+
+struct StoreRecord
+{
+    uint32_t keyLen;
+    uint32_t valueLen;
+    uint64_t checksum;
+};
+
+uint64_t StoreChecksum(const char * key, uint32_t keyLen, const char * value, uint32_t valueLen)
+{
+    uint64_t h = 14695981039346656037ULL;
+    auto mix = [&h](const char * data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            h = (h ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+        }
+    };
+    mix(reinterpret_cast<const char *>(&keyLen), sizeof(keyLen));
+    mix(reinterpret_cast<const char *>(&valueLen), sizeof(valueLen));
+    mix(key, keyLen);
+    mix(value, valueLen == kStoreErased ? 0 : valueLen);
+    return h;
+}
+
+uint64_t StoreRecordSize(uint32_t keyLen, uint32_t valueLen)
+{
+    const uint64_t size = sizeof(StoreRecord) + keyLen + (valueLen == kStoreErased ? 0 : valueLen);
+    return (size + 7) & ~uint64_t(7);
+}
+
+/// Cache directory of the running script. Exported by scracc, otherwise
+/// derived the way scracc derives it, with the executable standing in for
+/// the script: $SCRACC_CACHE_DIR (or ~/.cache/scracc) / md5 of its path.
+/// @return "" if it cannot be determined.
+string ScriptCacheDir()
+{
+    bool ok = false;
+    const string dir = GetEnv("SCRACC_SCRIPT_CACHE_DIR", &ok);
+    if (ok && !dir.empty()) {
+        return dir;
+    }
+    const string exePath = ReadLink("/proc/self/exe", &ok);
+    if (!ok || exePath.empty()) {
+        return "";
+    }
+    string cacheDir = GetEnv("SCRACC_CACHE_DIR", &ok);
+    if (cacheDir.empty()) {
+        const string homeDir = GetEnv("HOME", &ok);
+        if (homeDir.empty()) {
+            return "";
+        }
+        cacheDir = BuildPath( { homeDir, ".cache/scracc" } );
+    }
+    const string pathMd5 = Md5Sum(exePath, &ok);
+    if (!ok) {
+        return "";
+    }
+    const string ret = AbsolutePath(BuildPath( { cacheDir, pathMd5 } ), &ok);
+    if (!ok) {
+        return "";
+    }
+    // scracc creates it for scripts, plain programs may be the first.
+    MkDirPath(ret, &ok);
+    return ok ? ret : "";
+}
+
+/// Hash of a file's contents, or of a whole tree for directories.
+string InputHash(const string & inputPath, bool & success)
+{
+    if (IsDir(inputPath, &success)) {
+        return HashTree(inputPath, HashTreeOptions(), &success);
+    }
+    string digest;
+    success = HashFileContents(inputPath, digest);
+    return ToHex(digest);
+}
+
+} // namespace anonymous
+
+struct Store::Impl
+{
+    Impl() : fd(-1), map(nullptr), mapSize(0), indexedEnd(kStoreHeaderSize) {}
+
+    string filePath;
+    int fd;
+    char * map;
+    uint64_t mapSize;
+    uint64_t indexedEnd;
+    unordered_map<string, pair<uint64_t, uint32_t> > index;  // value offset, length
+
+    uint64_t Committed() const
+    {
+        return __atomic_load_n(reinterpret_cast<uint64_t *>(map + kStoreCommittedOffset),
+                               __ATOMIC_ACQUIRE);
+    }
+
+    bool Map(uint64_t size);
+    bool Open();
+    bool Refresh();
+    bool Append(const string & key, const char * value, uint32_t valueLen);
+    void Close();
+};
+
+bool Store::Impl::Map(uint64_t size)
+{
+    if (size <= mapSize) {
+        return true;
+    }
+    void * m = map
+               ? mremap(map, mapSize, size, MREMAP_MAYMOVE)
+               : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        return false;
+    }
+    map = static_cast<char *>(m);
+    mapSize = size;
+    return true;
+}
+
+bool Store::Impl::Open()
+{
+    fd = open(filePath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+        return false;
+    }
+    struct stat st;
+    bool success = (fstat(fd, &st) == 0);
+    if (success && uint64_t(st.st_size) < kStoreHeaderSize) {
+        char header[kStoreHeaderSize] = {};
+        memcpy(header, kStoreMagic, sizeof(kStoreMagic));
+        memcpy(header + kStoreCommittedOffset, &kStoreHeaderSize, sizeof(kStoreHeaderSize));
+        success = (pwrite(fd, header, sizeof(header), 0) == ssize_t(sizeof(header)))
+                  && (fdatasync(fd) == 0)
+                  && (fstat(fd, &st) == 0);
+    }
+    success = success
+              && Map(st.st_size)
+              && (memcmp(map, kStoreMagic, sizeof(kStoreMagic)) == 0)
+              && Committed() <= mapSize;
+    flock(fd, LOCK_UN);
+    return success && Refresh();
+}
+
+/// Indexes the records other processes (or we) committed since last time.
+bool Store::Impl::Refresh()
+{
+    const uint64_t committed = Committed();
+    // A torn or corrupt header must not point into the header, between
+    // records or back over indexed ones: Append() writes at this offset.
+    if (committed < indexedEnd || committed % 8 != 0) {
+        return false;
+    }
+    if (committed > mapSize) {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !Map(st.st_size) || committed > mapSize) {
+            return false;
+        }
+    }
+    while (indexedEnd < committed) {
+        StoreRecord rec;
+        memcpy(&rec, map + indexedEnd, sizeof(rec));
+        const char * key = map + indexedEnd + sizeof(rec);
+        const uint64_t size = StoreRecordSize(rec.keyLen, rec.valueLen);
+        if (indexedEnd + size > committed
+            || rec.checksum != StoreChecksum(key, rec.keyLen, key + rec.keyLen, rec.valueLen)) {
+            return false;
+        }
+        if (rec.valueLen == kStoreErased) {
+            index.erase(string(key, rec.keyLen));
+        }
+        else {
+            index[string(key, rec.keyLen)] = make_pair(indexedEnd + sizeof(rec) + rec.keyLen,
+                                                       rec.valueLen);
+        }
+        indexedEnd += size;
+    }
+    return true;
+}
+
+bool Store::Impl::Append(const string & key, const char * value, uint32_t valueLen)
+{
+    if (fd < 0 || key.size() >= kStoreErased
+        || (valueLen != kStoreErased && uint64_t(valueLen) + key.size() >= kStoreErased)) {
+        return false;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        return false;
+    }
+    bool success = Refresh();
+    const uint64_t offset = Committed();
+    const uint64_t size = StoreRecordSize(key.size(), valueLen);
+    if (success && offset + size > mapSize) {
+        // Grow geometrically so that appends stay cheap.
+        const uint64_t newSize = max(offset + size, max<uint64_t>(2 * mapSize, 1 << 20));
+        success = (ftruncate(fd, newSize) == 0) && Map(newSize);
+    }
+    if (success) {
+        StoreRecord rec;
+        rec.keyLen = key.size();
+        rec.valueLen = valueLen;
+        rec.checksum = StoreChecksum(key.data(), rec.keyLen, value, valueLen);
+        memcpy(map + offset, &rec, sizeof(rec));
+        memcpy(map + offset + sizeof(rec), key.data(), key.size());
+        if (valueLen != kStoreErased) {
+            memcpy(map + offset + sizeof(rec) + key.size(), value, valueLen);
+        }
+        // The record must be on disk before the header points past it.
+        const uint64_t pageMask = ~uint64_t(sysconf(_SC_PAGESIZE) - 1);
+        const uint64_t syncBegin = offset & pageMask;
+        success = (msync(map + syncBegin, offset + size - syncBegin, MS_SYNC) == 0);
+        if (success) {
+            __atomic_store_n(reinterpret_cast<uint64_t *>(map + kStoreCommittedOffset),
+                             offset + size, __ATOMIC_RELEASE);
+            success = (msync(map, kStoreHeaderSize, MS_SYNC) == 0) && Refresh();
+        }
+    }
+    flock(fd, LOCK_UN);
+    return success;
+}
+
+void Store::Impl::Close()
+{
+    if (map) {
+        munmap(map, mapSize);
+        map = nullptr;
+        mapSize = 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    index.clear();
+    indexedEnd = kStoreHeaderSize;
+}
+
+/// Opens (or creates) a persistent key-value store.
+/// @param filePath The store file. If empty, "scracc.store" in the cache
+///                 directory of the running script is used, so the data
+///                 survives across runs but goes away with the cache.
+Store::Store(const string & filePath, bool * ok)
+    : mImpl (new Impl)
+{
+    SPP_PROFILE(StoreOpen);
+    mImpl->filePath = filePath;
+    if (filePath.empty()) {
+        const string cacheDir = ScriptCacheDir();
+        bool success = !cacheDir.empty();
+        if (!success) {
+            SPP_FINISH("Cannot open store: unknown script cache directory");
+            return;
+        }
+        mImpl->filePath = BuildPath( { cacheDir, "scracc.store" } );
+    }
+    bool success = mImpl->Open();
+    if (!success) {
+        mImpl->Close();
+    }
+    SPP_FINISH(string("Cannot open store: ") + mImpl->filePath);
+}
+
+Store::~Store()
+{
+    mImpl->Close();
+}
+
+string Store::Get(const string & key, bool * ok)
+{
+    SPP_PROFILE(StoreGet);
+    string ret;
+    bool success = (mImpl->fd >= 0) && mImpl->Refresh();
+    if (success) {
+        const auto it = mImpl->index.find(key);
+        success = (it != mImpl->index.end());
+        if (success) {
+            ret.assign(mImpl->map + it->second.first, it->second.second);
+            sppProfile.AddRead(ret.size());
+        }
+    }
+    SPP_FINISH_WITH_RET(string("Key not found in store: ") + key);
+}
+
+bool Store::Has(const string & key)
+{
+    SPP_PROFILE(StoreHas);
+    return mImpl->fd >= 0 && mImpl->Refresh() && mImpl->index.count(key) > 0;
+}
+
+void Store::Put(const string & key, const string & value, bool * ok)
+{
+    SPP_PROFILE(StorePut);
+    bool success = (value.size() < kStoreErased)
+                   && mImpl->Append(key, value.data(), value.size());
+    if (success) {
+        sppProfile.AddWritten(value.size());
+    }
+    SPP_FINISH(string("Cannot write store: ") + mImpl->filePath);
+}
+
+void Store::Erase(const string & key, bool * ok)
+{
+    SPP_PROFILE(StoreErase);
+    bool success = !Has(key) || mImpl->Append(key, nullptr, kStoreErased);
+    SPP_FINISH(string("Cannot write store: ") + mImpl->filePath);
+}
+
+vector<string> Store::Keys()
+{
+    SPP_PROFILE(StoreKeys);
+    vector<string> ret;
+    if (mImpl->fd >= 0 && mImpl->Refresh()) {
+        for (const auto & entry : mImpl->index) {
+            ret.push_back(entry.first);
+        }
+    }
+    return ret;
+}
+
+/// Rewrites the store with only the live values.
+/// Other processes holding the store open keep seeing the old file,
+/// so only compact when nobody else uses it.
+void Store::Compact(bool * ok)
+{
+    SPP_PROFILE(StoreCompact);
+    bool success = (mImpl->fd >= 0) && mImpl->Refresh();
+    const string tmpPath = mImpl->filePath + ".tmp";
+    if (success) {
+        Remove(tmpPath, &success);
+        Store compacted(tmpPath, &success);
+        for (const auto & entry : mImpl->index) {
+            if (!success) {
+                break;
+            }
+            compacted.Put(entry.first,
+                          string(mImpl->map + entry.second.first, entry.second.second),
+                          &success);
+        }
+    }
+    if (success) {
+        success = (::rename(tmpPath.c_str(), mImpl->filePath.c_str()) == 0);
+    }
+    if (success) {
+        mImpl->Close();
+        success = mImpl->Open();
+    }
+    SPP_FINISH(string("Cannot compact store: ") + mImpl->filePath);
+}
+
+/// Returns the stored value for key, or computes, stores and returns it.
+string Store::Memoize(const string & key, function<string()> compute)
+{
+    SPP_PROFILE(StoreMemoize);
+    bool found = false;
+    string ret = Get(key, &found);
+    if (!found) {
+        ret = CallUserCode(compute);
+        Put(key, ret);
+    }
+    return ret;
+}
+
+/// Like Memoize(key, compute), but the result is also tied to the contents
+/// of inputPath (a file or a directory tree). Changing the input
+/// recomputes the value; the stale entry is left for Compact().
+string Store::Memoize(const string & inputPath, const string & key, function<string()> compute)
+{
+    SPP_PROFILE(StoreMemoize);
+    bool success = false;
+    const string hash = InputHash(inputPath, success);
+    if (!success) {
+        // Nothing to key on, so just compute.
+        return CallUserCode(compute);
+    }
+    return Memoize(key + '\0' + hash, compute);
+}
+
+//####################################################################
+
+namespace
+{
+
+string sBenchGroup;
+double sBenchBaselineNs = 0;
+bool sBenchHeaderPending = true;
+
+/// Pins the calling thread to one CPU for its lifetime.
+class CpuPin
+{
+public:
+    explicit CpuPin(int cpu)
+        : mPinned (false)
+    {
+        if (cpu < 0 || sched_getaffinity(0, sizeof(mSaved), &mSaved) != 0) {
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        mPinned = (sched_setaffinity(0, sizeof(set), &set) == 0);
+    }
+    ~CpuPin()
+    {
+        if (mPinned) {
+            sched_setaffinity(0, sizeof(mSaved), &mSaved);
+        }
+    }
+private:
+    cpu_set_t mSaved;
+    bool mPinned;
+};
+
+void PrintBenchHeader()
+{
+    if (!sBenchGroup.empty()) {
+        cout << "== " << sBenchGroup << " ==" << endl;
+    }
+    cout << left << setw(28) << "benchmark" << right
+         << setw(12) << "iterations" << setw(14) << "min ns" << setw(14) << "median ns"
+         << setw(14) << "p99 ns" << setw(12) << "stddev %" << setw(12) << "vs first" << endl;
+    sBenchHeaderPending = false;
+}
+
+string JsonEscape(const string & text)
+{
+    string ret;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            ret.push_back('\\');
+        }
+        if (static_cast<unsigned char>(c) >= 0x20) {
+            ret.push_back(c);
+        }
+    }
+    return ret;
+}
+
+} // namespace anonymous
+
+BenchOptions::BenchOptions()
+    :  samples (30)
+      ,sampleTimeMs (10)
+      ,warmupMs (100)
+      ,cpu (sched_getcpu())
+      ,json (false)
+{
+    bool ok = false;
+    json = (GetEnv("SCRACC_BENCH", &ok) == "json");
+}
+
+/// Starts a new group of benchmarks that are compared to each other.
+void BenchGroup(const string & title)
+{
+    SPP_PROFILE(BenchGroup);
+    sBenchGroup = title;
+    sBenchBaselineNs = 0;
+    sBenchHeaderPending = true;
+}
+
+namespace Internal
+{
+
+uint64_t BenchClockNs()
+{
+    return MonotonicNs();
+}
+
+/// Calibrates the batch size, warms up, takes the samples and reports.
+BenchResult RunBench(const string & name,
+                     const function<uint64_t(uint64_t iterations)> & runBatch,
+                     const BenchOptions & options)
+{
+    SPP_PROFILE(Bench);
+    CpuPin pin(options.cpu);
+    const uint64_t targetNs = max(1.0, options.sampleTimeMs * 1e6);
+    const uint64_t warmupEndNs = MonotonicNs() + uint64_t(options.warmupMs * 1e6);
+
+    // Grow the batch until one takes sampleTimeMs. This is also warmup.
+    uint64_t iterations = 1;
+    while (true) {
+        const uint64_t ns = CallUserCode(runBatch, iterations);
+        if (ns >= targetNs) {
+            break;
+        }
+        const double factor = (ns == 0) ? 10.0 : 1.2 * targetNs / ns;
+        iterations = max(iterations + 1, uint64_t(iterations * min(10.0, factor)));
+    }
+    while (MonotonicNs() < warmupEndNs) {
+        CallUserCode(runBatch, iterations);
+    }
+
+    vector<double> perIteration;
+    for (unsigned i = 0; i < max(1u, options.samples); ++i) {
+        perIteration.push_back(double(CallUserCode(runBatch, iterations)) / iterations);
+    }
+    sort(begin(perIteration), end(perIteration));
+    const size_t n = perIteration.size();
+    double mean = 0;
+    for (double t : perIteration) {
+        mean += t;
+    }
+    mean /= n;
+    double variance = 0;
+    for (double t : perIteration) {
+        variance += (t - mean) * (t - mean);
+    }
+    variance /= max<size_t>(1, n - 1);
+
+    BenchResult ret;
+    ret.name = name;
+    ret.iterations = iterations;
+    ret.minNs = perIteration.front();
+    ret.medianNs = (n % 2) ? perIteration[n / 2]
+                           : (perIteration[n / 2 - 1] + perIteration[n / 2]) / 2;
+    ret.p99Ns = perIteration[min(n - 1, size_t(ceil(0.99 * n)) - 1)];
+    ret.meanNs = mean;
+    ret.stddevNs = sqrt(variance);
+
+    if (sBenchBaselineNs == 0) {
+        sBenchBaselineNs = ret.medianNs;
+    }
+    const double relative = ret.medianNs / sBenchBaselineNs;
+    if (options.json) {
+        cout << "{\"group\":\"" << JsonEscape(sBenchGroup) << "\""
+             << ",\"name\":\"" << JsonEscape(name) << "\""
+             << ",\"iterations\":" << ret.iterations
+             << ",\"samples\":" << n
+             << ",\"min_ns\":" << ret.minNs
+             << ",\"median_ns\":" << ret.medianNs
+             << ",\"p99_ns\":" << ret.p99Ns
+             << ",\"mean_ns\":" << ret.meanNs
+             << ",\"stddev_ns\":" << ret.stddevNs
+             << ",\"relative\":" << relative << "}" << endl;
+    }
+    else {
+        if (sBenchHeaderPending) {
+            PrintBenchHeader();
+        }
+        const ios::fmtflags flags = cout.flags();
+        cout << left << setw(28) << name << right << fixed << setprecision(2)
+             << setw(12) << ret.iterations
+             << setw(14) << ret.minNs
+             << setw(14) << ret.medianNs
+             << setw(14) << ret.p99Ns
+             << setw(12) << 100 * ret.stddevNs / mean
+             << defaultfloat << setprecision(3)
+             << setw(11) << relative << "x" << endl;
+        cout.flags(flags);
+    }
+    return ret;
+}
+
+} // namespace Internal
+
+//####################################################################
+
+namespace
+{
+
+/// Closes a file descriptor when leaving the scope, also when a record
+/// callback throws.
+class FdCloser
+{
+public:
+    explicit FdCloser(int fd) : mFd (fd) {}
+    ~FdCloser()
+    {
+        if (mFd >= 0) {
+            close(mFd);
+        }
+    }
+private:
+    int mFd;
+
+    FdCloser(const FdCloser &);
+    FdCloser & operator=(const FdCloser &);
+};
+
+/// Unmaps a mapping when leaving the scope.
+class MapCloser
+{
+public:
+    MapCloser(void * addr, size_t size) : mAddr (addr), mSize (size) {}
+    ~MapCloser()
+    {
+        munmap(mAddr, mSize);
+    }
+private:
+    void * mAddr;
+    size_t mSize;
+
+    MapCloser(const MapCloser &);
+    MapCloser & operator=(const MapCloser &);
+};
+
+/// Reads the file through one buffer and hands out the complete records
+/// in it; the unfinished record at the end is moved to the front.
+/// @return false if the file could not be read.
+bool StreamRecordChunks(int fd, char delimiter, size_t bufferSize,
+                        const function<bool(const char *, const char *)> & chunk,
+                        uint64_t & bytesRead)
+{
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    vector<char> buf(max<size_t>(bufferSize, 4096));
+    size_t filled = 0;
+    while (true) {
+        if (filled == buf.size()) {
+            // A single record is longer than the buffer.
+            buf.resize(2 * buf.size());
+        }
+        const ssize_t n = read(fd, buf.data() + filled, buf.size() - filled);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytesRead += n;
+        if (n == 0) {
+            // The last record may lack its delimiter.
+            if (filled > 0) {
+                CallUserCode(chunk, buf.data(), buf.data() + filled);
+            }
+            return true;
+        }
+        const size_t scanFrom = filled;
+        filled += n;
+        const char * last = static_cast<const char *>(
+                                memrchr(buf.data() + scanFrom, delimiter, filled - scanFrom));
+        if (!last) {
+            continue;
+        }
+        const size_t complete = last + 1 - buf.data();
+        if (!CallUserCode(chunk, buf.data(), buf.data() + complete)) {
+            return true;
+        }
+        memmove(buf.data(), buf.data() + complete, filled - complete);
+        filled -= complete;
+    }
+}
+
+/// Maps the file and processes parts of it, cut at record boundaries,
+/// on the shared pool.
+/// @return false if the file cannot be mapped (e.g. a pipe).
+bool ParallelRecordChunks(int fd, char delimiter,
+                          const function<bool(const char *, const char *)> & chunk,
+                          uint64_t & bytesRead)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    const size_t size = st.st_size;
+    if (size == 0) {
+        return true;
+    }
+    void * m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) {
+        return false;
+    }
+    MapCloser unmap(m, size);
+    madvise(m, size, MADV_SEQUENTIAL);
+    const char * data = static_cast<const char *>(m);
+    const char * end = data + size;
+
+    // Part i starts right after the first delimiter at or after i * size / parts.
+    const size_t parts = max<size_t>(1, min<size_t>(size / (64 * 1024), 4 * ThreadPool::Shared().Size()));
+    vector<const char *> bounds(1, data);
+    for (size_t i = 1; i < parts; ++i) {
+        const char * from = max(bounds.back(), data + i * (size / parts));
+        const char * found = static_cast<const char *>(memchr(from, delimiter, end - from));
+        if (!found) {
+            break;
+        }
+        bounds.push_back(found + 1);
+    }
+    bounds.push_back(end);
+
+    atomic<bool> stop(false);
+    ThreadPool::Shared().Run(bounds.size() - 1, [&](size_t i) {
+        if (!stop && bounds[i] < bounds[i + 1] && !CallUserCode(chunk, bounds[i], bounds[i + 1])) {
+            stop = true;
+        }
+    });
+    bytesRead += size;
+    return true;
+}
+
+} // namespace anonymous
+
+namespace Internal
+{
+
+/// Delivers [begin, end) ranges holding only complete records to chunk().
+/// The ranges never end in the middle of a record.
+void ForEachRecordChunk(const string & filePath, char delimiter, const RecordOptions & options,
+                        const function<bool(const char * begin, const char * end)> & chunk,
+                        bool * ok)
+{
+    SPP_PROFILE(ForEachRecord);
+    uint64_t bytesRead = 0;
+    const int fd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    FdCloser closer(fd);
+    bool success = (fd >= 0);
+    if (success) {
+        if (!options.parallel || !ParallelRecordChunks(fd, delimiter, chunk, bytesRead)) {
+            success = StreamRecordChunks(fd, delimiter, options.bufferSize, chunk, bytesRead);
+        }
+    }
+    sppProfile.AddRead(bytesRead);
+    SPP_FINISH(string("Cannot read file: ") + filePath);
+}
+
+} // namespace Internal
+
+//####################################################################
+
 } // namespace Scracc
 
 //####################################################################
@@ -20,9 +20,16 @@
 //
 
 #include <cstdint> // uintmax_t
+#include <cstring> // memchr()
 
+#include <algorithm> // min(), max()
+#include <atomic>
+#include <type_traits> // decay<>
 #include <functional> // function<>
 #include <initializer_list>
+#include <future> // future<>
+#include <memory> // unique_ptr<>
+#include <utility> // pair<>, move()
 
 #include <vector>
 #include <string>
@@ -32,6 +39,22 @@ namespace Scracc
 
 using namespace std;
 
+enum PathNormalization
+{
+    NormalizeSlashes = 0x1,        // "a//b"    -> "a/b"
+    NormalizeDots = 0x2,           // "a/./b/.." -> "a" (implies NormalizeSlashes)
+    NormalizeTrailingSlash = 0x4,  // "a/b/"    -> "a/b"
+    NormalizeAll = 0x7
+};
+
+struct HashTreeOptions
+{
+    HashTreeOptions() : threads(0), followSymlink(false) {}
+    unsigned threads;      // worker threads, 0 means one per core
+    bool followSymlink;    // hash the targets instead of the links
+    string cacheFile;      // stat-keyed digest cache, empty means no cache
+};
+
 void SetThrowExceptions(bool throwExceptions);
 
 void SetEnv(const string & name, const string & value, bool * ok = nullptr);
@@ -39,6 +62,10 @@ string GetEnv(const string & name, bool * ok = nullptr);
 string Md5Sum(const string & message, bool * ok = nullptr);
 string ReadFile(const string & filePath, bool * ok = nullptr);
 void WriteFile(const string & filePath, const string & contents, bool * ok = nullptr);
+vector<string> ReadFiles(const vector<string> & filePaths, bool * ok = nullptr);
+void WriteFiles(const vector<pair<string, string> > & files, bool * ok = nullptr);
+future<vector<string> > ReadFilesAsync(const vector<string> & filePaths);
+future<void> WriteFilesAsync(const vector<pair<string, string> > & files);
 int Execute(const string & command, bool * ok = nullptr);
 string GetCwd(bool * ok = nullptr);
 void ChDir(const string & dirPath, bool * ok = nullptr);
@@ -46,8 +73,13 @@ void MkDir(const string & dirPath, bool * ok = nullptr);
 void MkDirPath(const string & dirPath, bool * ok = nullptr);
 void Remove(const string & filePath, bool * ok = nullptr);
 void RemoveAll(const string & filePath, bool * ok = nullptr);
+void CopyFile(const string & from, const string & to, bool preserveMetadata = false, bool * ok = nullptr);
+void CopyTree(const string & from, const string & to, bool preserveMetadata = false, bool * ok = nullptr);
+void MoveTree(const string & from, const string & to, bool * ok = nullptr);
 string BaseName(const string & filePath, bool * ok = nullptr);
 string DirName(const string & filePath, bool * ok = nullptr);
+size_t NormalizePath(const char * path, size_t length, char * out, unsigned flags = NormalizeAll);
+string NormalizePath(const string & path, unsigned flags = NormalizeAll);
 string AbsolutePath(const string & relPath, bool * ok = nullptr);
 string BuildPath(initializer_list<string> parts);
 bool Exists(const string & filePath, bool * ok = nullptr);
@@ -73,6 +105,318 @@ void FindAndDo(const string & startPath,
                function<bool(const string & path)> action,
                int depth = 0,
                bool followSymlink = false);
+string HashTree(const string & rootPath,
+                const HashTreeOptions & options = HashTreeOptions(),
+                bool * ok = nullptr);
+
+class Store
+{
+public:
+    explicit Store(const string & filePath = "", bool * ok = nullptr);
+    ~Store();
+    string Get(const string & key, bool * ok = nullptr);
+    bool Has(const string & key);
+    void Put(const string & key, const string & value, bool * ok = nullptr);
+    void Erase(const string & key, bool * ok = nullptr);
+    vector<string> Keys();
+    void Compact(bool * ok = nullptr);
+    string Memoize(const string & key, function<string()> compute);
+    string Memoize(const string & inputPath, const string & key, function<string()> compute);
+private:
+    struct Impl;
+    unique_ptr<Impl> mImpl;
+
+    Store(const Store &);
+    Store & operator=(const Store &);
+};
+
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned threads = 0);
+    ~ThreadPool();
+    unsigned Size() const;
+    void Run(size_t count, const function<void(size_t)> & task);
+    static ThreadPool & Shared();
+private:
+    struct Impl;
+    unique_ptr<Impl> mImpl;
+
+    ThreadPool(const ThreadPool &);
+    ThreadPool & operator=(const ThreadPool &);
+};
+
+struct ParallelOptions
+{
+    ParallelOptions() : grainSize(0), cancel(nullptr) {}
+    size_t grainSize;        // indices per task, 0 means automatic
+    atomic<bool> * cancel;   // set it to stop starting new chunks
+};
+
+namespace Internal
+{
+
+inline size_t GrainSize(size_t count, const ParallelOptions & options)
+{
+    return options.grainSize
+           ? options.grainSize
+           : max<size_t>(1, count / (8 * ThreadPool::Shared().Size()));
+}
+
+/// Splits [first, last) into chunks and runs chunk(begin, end) for each
+/// on the shared pool. The pool only sees one std::function call per
+/// chunk; the per-index work stays inlined in the caller's template.
+/// @return false if it was cancelled.
+template <typename Chunk>
+bool RunChunked(size_t first, size_t last, const ParallelOptions & options, Chunk chunk)
+{
+    if (first >= last) {
+        return true;
+    }
+    const size_t count = last - first;
+    const size_t grain = GrainSize(count, options);
+    const size_t chunks = (count + grain - 1) / grain;
+    atomic<bool> * cancel = options.cancel;
+    ThreadPool::Shared().Run(chunks, [&](size_t c) {
+        if (cancel && cancel->load(memory_order_relaxed)) {
+            return;
+        }
+        const size_t b = first + c * grain;
+        chunk(c, b, min(last, b + grain));
+    });
+    return !(cancel && cancel->load());
+}
+
+/// vector<bool> packs its elements into shared words, so parallel writes
+/// to neighbouring indices would race. Results are collected in a plain
+/// char buffer instead and repacked at the end.
+template <typename T>
+struct Unpacked
+{
+    typedef T type;
+    static vector<T> Repack(vector<T> && buffer) { return std::move(buffer); }
+};
+
+template <>
+struct Unpacked<bool>
+{
+    typedef char type;
+    static vector<bool> Repack(vector<char> && buffer)
+    {
+        return vector<bool>(buffer.begin(), buffer.end());
+    }
+};
+
+} // namespace Internal
+
+/// Calls body(i) for every i in [first, last) on the shared thread pool.
+/// @return false if it was cancelled through options.cancel.
+template <typename Body>
+bool ParallelFor(size_t first, size_t last, Body body,
+                 const ParallelOptions & options = ParallelOptions())
+{
+    return Internal::RunChunked(first, last, options,
+                                [&body](size_t, size_t b, size_t e) {
+                                    for (size_t i = b; i < e; ++i) {
+                                        body(i);
+                                    }
+                                });
+}
+
+/// Returns { f(input[0]), f(input[1]), ... }, computed in parallel.
+/// @param completed set to false if it was cancelled through options.cancel,
+///                  the skipped elements are then value-initialized.
+template <typename T, typename F>
+auto ParallelMap(const vector<T> & input, F f,
+                 const ParallelOptions & options = ParallelOptions(),
+                 bool * completed = nullptr)
+    -> vector<typename decay<decltype(f(input[0]))>::type>
+{
+    typedef typename decay<decltype(f(input[0]))>::type R;
+    vector<typename Internal::Unpacked<R>::type> output(input.size());
+    const bool finished = ParallelFor(0, input.size(),
+                                      [&](size_t i) { output[i] = f(input[i]); }, options);
+    if (completed) {
+        *completed = finished;
+    }
+    return Internal::Unpacked<R>::Repack(std::move(output));
+}
+
+/// Returns combine(... combine(combine(identity, map(first)), map(first + 1)) ...).
+/// Chunks are reduced in parallel and their results are combined in order,
+/// so combine has to be associative but not commutative.
+/// @param completed set to false if it was cancelled through options.cancel,
+///                  the result then only covers the chunks that ran.
+template <typename T, typename Map, typename Combine>
+T ParallelReduce(size_t first, size_t last, T identity, Map map, Combine combine,
+                 const ParallelOptions & options = ParallelOptions(),
+                 bool * completed = nullptr)
+{
+    const size_t count = (last > first) ? last - first : 0;
+    const size_t grain = Internal::GrainSize(count, options);
+    vector<typename Internal::Unpacked<T>::type> partials((count + grain - 1) / grain, identity);
+    ParallelOptions chunked = options;
+    chunked.grainSize = grain;
+    const bool finished =
+        Internal::RunChunked(first, last, chunked,
+                             [&](size_t c, size_t b, size_t e) {
+                                 T acc = identity;
+                                 for (size_t i = b; i < e; ++i) {
+                                     acc = combine(acc, map(i));
+                                 }
+                                 partials[c] = acc;
+                             });
+    if (completed) {
+        *completed = finished;
+    }
+    T ret = identity;
+    for (const auto & p : partials) {
+        ret = combine(ret, p);
+    }
+    return ret;
+}
+
+/// Calls action(path) in parallel for every path Find() would return.
+/// @return false if it was cancelled through options.cancel.
+template <typename Predicate, typename Action>
+bool ParallelForEachFile(const string & startPath, Predicate predicate, Action action,
+                         size_t depth = 0, bool followSymlink = false,
+                         const ParallelOptions & options = ParallelOptions())
+{
+    const vector<string> files = Find(startPath, predicate, depth, followSymlink);
+    return ParallelFor(0, files.size(), [&](size_t i) { action(files[i]); }, options);
+}
+
+struct BenchOptions
+{
+    BenchOptions();
+    unsigned samples;      // timed samples
+    double sampleTimeMs;   // iterations per sample are calibrated to take this long
+    double warmupMs;       // minimum time spent running before sampling
+    int cpu;               // pin to this CPU, -1 means no pinning (default: current CPU)
+    bool json;             // JSON lines instead of a table (default: SCRACC_BENCH=json)
+};
+
+struct BenchResult
+{
+    string name;
+    uint64_t iterations;   // per sample
+    double minNs;          // all times are per iteration
+    double medianNs;
+    double p99Ns;
+    double meanNs;
+    double stddevNs;
+};
+
+/// Keeps the compiler from optimizing away the computation of value.
+template <typename T>
+inline void DoNotOptimize(const T & value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/// Forces pending writes to memory to be treated as observable.
+inline void ClobberMemory()
+{
+    asm volatile("" : : : "memory");
+}
+
+namespace Internal
+{
+
+uint64_t BenchClockNs();
+BenchResult RunBench(const string & name,
+                     const function<uint64_t(uint64_t iterations)> & runBatch,
+                     const BenchOptions & options);
+
+} // namespace Internal
+
+void BenchGroup(const string & title);
+
+/// Measures f() and prints a result row.
+/// The first benchmark of a BenchGroup() is the baseline the others
+/// are compared to.
+template <typename F>
+BenchResult Bench(const string & name, F f, const BenchOptions & options = BenchOptions())
+{
+    // Only whole batches go through std::function, f() itself is inlined.
+    return Internal::RunBench(name, [&f](uint64_t iterations) {
+        const uint64_t start = Internal::BenchClockNs();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            f();
+            ClobberMemory();
+        }
+        return Internal::BenchClockNs() - start;
+    }, options);
+}
+
+struct RecordOptions
+{
+    RecordOptions() : bufferSize(1 << 20), parallel(false) {}
+    size_t bufferSize;     // read buffer, grows for longer records
+    bool parallel;         // split the file at record boundaries and process the
+                           // parts on the thread pool; records arrive out of order
+};
+
+namespace Internal
+{
+
+void ForEachRecordChunk(const string & filePath, char delimiter, const RecordOptions & options,
+                        const function<bool(const char * begin, const char * end)> & chunk,
+                        bool * ok);
+
+template <typename Callback>
+auto InvokeRecord(Callback & callback, const char * data, size_t size, int)
+    -> decltype(bool(callback(data, size)))
+{
+    return callback(data, size);
+}
+
+template <typename Callback>
+bool InvokeRecord(Callback & callback, const char * data, size_t size, long)
+{
+    callback(data, size);
+    return true;
+}
+
+/// Calls callback for each record in [begin, end).
+/// @return false if the callback asked to stop.
+template <typename Callback>
+bool SplitRecords(const char * begin, const char * end, char delimiter, Callback & callback)
+{
+    while (begin < end) {
+        const char * found = static_cast<const char *>(memchr(begin, delimiter, end - begin));
+        const char * recordEnd = found ? found : end;
+        if (!InvokeRecord(callback, begin, size_t(recordEnd - begin), 0)) {
+            return false;
+        }
+        begin = recordEnd + 1;
+    }
+    return true;
+}
+
+} // namespace Internal
+
+/// Streams a file and calls callback(data, size) for every record,
+/// without the delimiter. The data points into an internal buffer and is
+/// only valid during the call. If the callback returns a bool, false stops.
+template <typename Callback>
+void ForEachRecord(const string & filePath, char delimiter, Callback callback,
+                   const RecordOptions & options = RecordOptions(), bool * ok = nullptr)
+{
+    Internal::ForEachRecordChunk(filePath, delimiter, options,
+                                 [&](const char * begin, const char * end) {
+                                     return Internal::SplitRecords(begin, end, delimiter, callback);
+                                 }, ok);
+}
+
+/// ForEachRecord() with '\n' as the delimiter.
+template <typename Callback>
+void ForEachLine(const string & filePath, Callback callback,
+                 const RecordOptions & options = RecordOptions(), bool * ok = nullptr)
+{
+    ForEachRecord(filePath, '\n', callback, options, ok);
+}
 
 } // namespace Scracc
 
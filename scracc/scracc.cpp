@@ -294,6 +294,8 @@ int Builder::Run()
         command.append(" \"").append(arg).append("\"");
     }
     DEBUG(string("cmd = ") + command);
+    // Lets Scracc::Store find the per-script cache directory.
+    Scracc::SetEnv("SCRACC_SCRIPT_CACHE_DIR", mCacheDir);
     return Scracc::Execute(command);
 }
 